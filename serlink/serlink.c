@@ -13,6 +13,7 @@
 
 
 #define SERDEV_FILE	"serial.dev"
+#define SERDEV_ENV	"SERDEV"
 
 #define BLOCK_SIZE	512
 
@@ -61,6 +62,7 @@ static struct termios origOptions;
 static struct termios currOptions;
 
 static int run;
+static int failed;
 
 
 void serialClose(void);
@@ -83,6 +85,16 @@ void error(char *fmt, ...) {
 }
 
 
+void cmdError(char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  failed = 1;
+}
+
+
 int tokenize(char *line, char *tokens[], int maxTokens) {
   int n;
   char *p;
@@ -322,7 +334,7 @@ void ping(int argc, char *argv[]) {
   if (b == NAK) {
     printf("NAK from Oberon system\n");
   } else {
-    printf("error: unknown answer from Oberon system\n");
+    cmdError("error: unknown answer from Oberon system\n");
   }
 }
 
@@ -335,20 +347,20 @@ void h2oSingleFile(char *name) {
 
   file = fopen(name, "r");
   if (file == NULL) {
-    printf("error: cannot open file '%s' for read on host\n", name);
+    cmdError("error: cannot open file '%s' for read on host\n", name);
     return;
   }
   sndByte(REC);
   b = rcvByte();
   if (b != ACK) {
-    printf("error: no ACK from Oberon system for REC request\n");
+    cmdError("error: no ACK from Oberon system for REC request\n");
     fclose(file);
     return;
   }
   sndStr(name);
   b = rcvByte();
   if (b != ACK) {
-    printf("error: no ACK for filename '%s' from Oberon system\n", name);
+    cmdError("error: no ACK for filename '%s' from Oberon system\n", name);
     fclose(file);
     return;
   }
@@ -361,7 +373,7 @@ void h2oSingleFile(char *name) {
       sndByte(0);
       b = rcvByte();
       if (b != ACK) {
-        printf("error: no ACK for file data from Oberon system\n");
+        cmdError("error: no ACK for file data from Oberon system\n");
         fclose(file);
         return;
       }
@@ -373,7 +385,7 @@ void h2oSingleFile(char *name) {
     }
     b = rcvByte();
     if (b != ACK) {
-      printf("error: no ACK for file data from Oberon system\n");
+      cmdError("error: no ACK for file data from Oberon system\n");
       fclose(file);
       return;
     }
@@ -385,7 +397,7 @@ void h2oSingleFile(char *name) {
   sndByte(REQ);
   b = rcvByte();
   if (b != ACK) {
-    printf("error: no ACK from Oberon system (file '%s')\n", name);
+    cmdError("error: no ACK from Oberon system (file '%s')\n", name);
   } else {
     printf("ACK from Oberon system (file '%s')\n", name);
   }
@@ -409,20 +421,20 @@ void o2hSingleFile(char *name) {
 
   file = fopen(name, "w");
   if (file == NULL) {
-    printf("error: cannot open file '%s' for write on host\n", name);
+    cmdError("error: cannot open file '%s' for write on host\n", name);
     return;
   }
   sndByte(SND);
   b = rcvByte();
   if (b != ACK) {
-    printf("error: no ACK from Oberon system for SND request\n");
+    cmdError("error: no ACK from Oberon system for SND request\n");
     fclose(file);
     return;
   }
   sndStr(name);
   b = rcvByte();
   if (b != ACK) {
-    printf("error: no ACK for filename '%s' from Oberon system\n", name);
+    cmdError("error: no ACK for filename '%s' from Oberon system\n", name);
     fclose(file);
     return;
   }
@@ -447,7 +459,7 @@ void o2hSingleFile(char *name) {
   sndByte(REQ);
   b = rcvByte();
   if (b != ACK) {
-    printf("error: no ACK from Oberon system (file '%s')\n", name);
+    cmdError("error: no ACK from Oberon system (file '%s')\n", name);
   } else {
     printf("ACK from Oberon system (file '%s')\n", name);
   }
@@ -471,13 +483,13 @@ void calln(int argc, char *argv[]) {
   sndByte(CAL);
   b = rcvByte();
   if (b != ACK) {
-    printf("error: no ACK from Oberon system for CAL request\n");
+    cmdError("error: no ACK from Oberon system for CAL request\n");
     return;
   }
   sndStr(argv[1]);
   b = rcvByte();
   if (b != ACK) {
-    printf("error: no ACK for command '%s' from Oberon system\n", argv[1]);
+    cmdError("error: no ACK for command '%s' from Oberon system\n", argv[1]);
     return;
   }
   sndByte(argc - 2);
@@ -485,7 +497,7 @@ void calln(int argc, char *argv[]) {
     sndStr(argv[i]);
     b = rcvByte();
     if (b != ACK) {
-      printf("error: no ACK for argument '%s' from Oberon system\n", argv[i]);
+      cmdError("error: no ACK for argument '%s' from Oberon system\n", argv[i]);
       return;
     }
   }
@@ -504,7 +516,7 @@ void xscript(int argc, char *argv[]) {
 
   script = fopen(argv[1], "r");
   if (script == NULL) {
-    printf("error: cannot open script file '%s'\n", argv[1]);
+    cmdError("error: cannot open script file '%s'\n", argv[1]);
     return;
   }
   lnum = 0;
@@ -520,12 +532,12 @@ void xscript(int argc, char *argv[]) {
     }
     cmd = lookupCmd(tokens[0]);
     if (cmd == NULL) {
-      printf("error in script: unknown command '%s'\n",
+      cmdError("error in script: unknown command '%s'\n",
              tokens[0]);
       continue;
     }
     if (n < cmd->minArgc) {
-      printf("error in script: too few arguments for command '%s'\n",
+      cmdError("error in script: too few arguments for command '%s'\n",
              tokens[0]);
       continue;
     }
@@ -583,12 +595,12 @@ void inspect(int argc, char *argv[]) {
 
   a = strtol(argv[1], &endp, 0);
   if (*endp != '\0') {
-    printf("error: cannot read address\n");
+    cmdError("error: cannot read address\n");
     return;
   }
   n = strtol(argv[2], &endp, 0);
   if (*endp != '\0') {
-    printf("error: cannot read count\n");
+    cmdError("error: cannot read count\n");
     return;
   }
   sndInt(CMD_INSPECT);
@@ -604,7 +616,7 @@ void filldsp(int argc, char *argv[]) {
 
   arg = strtol(argv[1], &endp, 0);
   if (*endp != '\0') {
-    printf("error: cannot read filler number\n");
+    cmdError("error: cannot read filler number\n");
     return;
   }
   sndInt(CMD_FILLDSP);
@@ -619,7 +631,7 @@ void sector(int argc, char *argv[]) {
 
   secno = strtol(argv[1], &endp, 0);
   if (*endp != '\0') {
-    printf("error: cannot read sector number\n");
+    cmdError("error: cannot read sector number\n");
     return;
   }
   sndInt(CMD_SECTOR);
@@ -647,7 +659,7 @@ void mirror(int argc, char *argv[]) {
 
   arg = strtol(argv[1], &endp, 10);
   if (*endp != '\0') {
-    printf("error: cannot read number to mirror\n");
+    cmdError("error: cannot read number to mirror\n");
     return;
   }
   sndInt(CMD_MIRROR);
@@ -790,20 +802,26 @@ int main(int argc, char *argv[]) {
   if (argc != 1 && argc != 2) {
     usage(argv[0]);
   }
-  serdevFile = fopen(SERDEV_FILE, "r");
-  if (serdevFile == NULL) {
-    error("cannot open file '%s' for reading the\npath to "
-          "the serial device. Please create this file.",
-          SERDEV_FILE);
-  }
-  if (fgets(serialPort, LINE_SIZE, serdevFile) == NULL) {
-    error("cannot read file '%s' (should contain a valid path).",
-          SERDEV_FILE);
-  }
-  fclose(serdevFile);
-  n = strlen(serialPort) - 1;
-  if (serialPort[n] == '\n') {
-    serialPort[n] = '\0';
+  if (getenv(SERDEV_ENV) != NULL) {
+    /* set by the simulator's batch mode */
+    strncpy(serialPort, getenv(SERDEV_ENV), LINE_SIZE - 1);
+    serialPort[LINE_SIZE - 1] = '\0';
+  } else {
+    serdevFile = fopen(SERDEV_FILE, "r");
+    if (serdevFile == NULL) {
+      error("cannot open file '%s' for reading the\npath to "
+            "the serial device. Please create this file.",
+            SERDEV_FILE);
+    }
+    if (fgets(serialPort, LINE_SIZE, serdevFile) == NULL) {
+      error("cannot read file '%s' (should contain a valid path).",
+            SERDEV_FILE);
+    }
+    fclose(serdevFile);
+    n = strlen(serialPort) - 1;
+    if (serialPort[n] == '\n') {
+      serialPort[n] = '\0';
+    }
   }
   if (argc == 1) {
     bootName = NULL;
@@ -839,15 +857,15 @@ int main(int argc, char *argv[]) {
     }
     cmd = lookupCmd(tokens[0]);
     if (cmd == NULL) {
-      printf("error: unknown command '%s', try 'h' for help\n", tokens[0]);
+      cmdError("error: unknown command '%s', try 'h' for help\n", tokens[0]);
       continue;
     }
     if (n < cmd->minArgc) {
-      printf("error: too few arguments for command '%s'\n", tokens[0]);
+      cmdError("error: too few arguments for command '%s'\n", tokens[0]);
       continue;
     }
     (*cmd->func)(n, tokens);
   }
   serialClose();
-  return 0;
+  return failed;
 }
@@ -12,6 +12,9 @@
 #include "graph.h"
 
 
+void (*errorHook)(void) = NULL;
+
+
 void error(char *fmt, ...) {
   va_list ap;
 
@@ -21,6 +24,9 @@ void error(char *fmt, ...) {
   vprintf(fmt, ap);
   printf("\n");
   va_end(ap);
+  if (errorHook != NULL) {
+    (*errorHook)();
+  }
   exit(1);
 }
 
@@ -17,5 +17,8 @@ typedef unsigned char Byte;
 void error(char *fmt, ...);
 void warning(char *fmt, ...);
 
+/* if set, called by error() instead of exiting, may not return */
+extern void (*errorHook)(void);
+
 
 #endif /* _COMMON_H_ */
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <math.h>
 #include <fenv.h>
+#include <time.h>
 
 #include "common.h"
 #include "fpu.h"
@@ -18,54 +19,556 @@ typedef union {
   float f;
 } FP_Union;
 
+typedef union {
+  unsigned long long l;
+  double d;
+} DP_Union;
 
-Word fpAdd(Word x, Word y, Bool sub) {
+
+#define OP_ADD		0		/* FAD and FSB */
+#define OP_MUL		1		/* FML */
+#define OP_DIV		2		/* FDV */
+#define OP_FLT		3		/* FLT */
+#define OP_FLR		4		/* FLR */
+#define NUM_OPS		5
+
+
+static Bool exactOnly = false;	/* use the hardware models only */
+static Bool checkFast = false;	/* compare fast results with models */
+
+/* operations done on each path, per machine */
+static __thread unsigned long fastCount[NUM_OPS];
+static __thread unsigned long slowCount[NUM_OPS];
+
+
+/**************************************************************/
+
+/*
+ * models of the hardware, bit by bit as in fpu.v
+ * (fpga/v1), including all of its quirks: no NaNs or
+ * infinities, no denormals, round half up on a single
+ * guard bit, and an adder which truncates its operands
+ */
+
+
+/*
+ * FAD, FSB, FLT and FLR share one adder;
+ * u = 1 is FLT (y = 0x4B000000), v = 1 is FLR (same y)
+ */
+static Word modelAdd(Word x, Word y, Bool u, Bool v) {
+  int xe, ye;
+  int xm, ym;
+  int x0, y0;
+  int dx, dy;
+  int sx, sy;
+  int e0, e1;
+  int sum, s;
+  int sc, t;
+
+  xe = u ? 0x96 : (x >> 23) & 0xFF;
+  ye = (y >> 23) & 0xFF;
+  xm = u ? (x & 0x00FFFFFF) << 1 : 0x01000000 | (x & 0x007FFFFF) << 1;
+  ym = (u || v ? 0 : 0x01000000) | (y & 0x007FFFFF) << 1;
+  /* mantissas as 26-bit two's complement numbers */
+  x0 = ((x & 0x80000000) && !u ? -xm : xm) & 0x01FFFFFF;
+  if (x & 0x80000000) {
+    x0 -= 0x02000000;
+  }
+  y0 = ((y & 0x80000000) && !u ? -ym : ym) & 0x01FFFFFF;
+  if (y & 0x80000000) {
+    y0 -= 0x02000000;
+  }
+  /* align the mantissa of the smaller exponent */
+  dx = (xe - ye) & 0x1FF;
+  dy = (ye - xe) & 0x1FF;
+  e0 = (dx & 0x100) ? ye : xe;
+  sx = (dy & 0x100) ? 0 : dy & 0xFF;
+  sy = (dx & 0x100) ? 0 : dx & 0xFF;
+  x0 >>= (sx < 32) ? sx : 31;
+  y0 >>= (sy < 32) ? sy : 31;
+  sum = x0 + y0;
+  if (v) {
+    /* FLR */
+    return (Word) (sum >> 1);
+  }
+  if ((x & 0x7FFFFFFF) == 0) {
+    return (u || (y & 0x7FFFFFFF) == 0) ? 0 : y;
+  }
+  if ((y & 0x7FFFFFFF) == 0) {
+    return x;
+  }
+  /* round (before normalizing!), normalize */
+  s = ((sum < 0 ? -sum : sum) + 1) & 0x07FFFFFF;
+  for (sc = 0; sc < 24; sc++) {
+    if (s & (0x02000000 >> sc)) {
+      break;
+    }
+  }
+  e1 = (e0 - sc + 1) & 0x1FF;
+  t = ((s >> 1) << sc) & 0x01FFFFFF;
+  if (t == 0 || (e1 & 0x100)) {
+    return 0;
+  }
+  return (sum < 0 ? 0x80000000 : 0) | (e1 << 23) | ((t >> 1) & 0x007FFFFF);
+}
+
+
+static Word modelMul(Word x, Word y) {
+  int xe, ye;
+  unsigned long long p;
+  Word sign;
+  int e1;
+  Word z0;
+
+  xe = (x >> 23) & 0xFF;
+  ye = (y >> 23) & 0xFF;
+  if (xe == 0 || ye == 0) {
+    return 0;
+  }
+  p = (unsigned long long) (0x00800000 | (x & 0x007FFFFF)) *
+      (0x00800000 | (y & 0x007FFFFF));
+  sign = (x ^ y) & 0x80000000;
+  e1 = (xe + ye - 127 + (int) (p >> 47)) & 0x1FF;
+  /* round, normalize: the carry of rounding is lost */
+  z0 = (((p >> 47) ? p >> 23 : p >> 22) + 1) & 0x01FFFFFF;
+  if ((e1 & 0x100) == 0) {
+    return sign | (e1 << 23) | ((z0 >> 1) & 0x007FFFFF);
+  }
+  if ((e1 & 0x080) == 0) {
+    /* overflow */
+    return sign | 0x7F800000 | ((z0 >> 1) & 0x007FFFFF);
+  }
+  /* underflow */
+  return 0;
+}
+
+
+static Word modelDiv(Word x, Word y) {
+  int xe, ye;
+  unsigned long long q;
+  Word sign;
+  int e1;
+  Word z0, z1;
+
+  xe = (x >> 23) & 0xFF;
+  ye = (y >> 23) & 0xFF;
+  sign = (x ^ y) & 0x80000000;
+  if (xe == 0) {
+    return 0;
+  }
+  if (ye == 0) {
+    /* division by zero */
+    return sign | 0x7F800000;
+  }
+  /* the 26 quotient bits of the restoring divider */
+  q = ((unsigned long long) (0x00800000 | (x & 0x007FFFFF)) << 25) /
+      (0x00800000 | (y & 0x007FFFFF));
+  e1 = (xe - ye + 126 + (int) (q >> 25)) & 0x1FF;
+  z0 = ((q >> 25) ? q >> 1 : q) & 0x01FFFFFF;
+  z1 = (z0 + 1) & 0x01FFFFFF;
+  if ((e1 & 0x100) == 0) {
+    return sign | (e1 << 23) | ((z1 >> 1) & 0x007FFFFF);
+  }
+  if ((e1 & 0x080) == 0) {
+    /* overflow, not rounded */
+    return sign | 0x7F800000 | ((z0 >> 1) & 0x007FFFFF);
+  }
+  /* underflow */
+  return 0;
+}
+
+
+/**************************************************************/
+
+/*
+ * fast versions, using the host's floating-point arithmetic;
+ * each one returns false if it cannot be sure to deliver
+ * the same result as the hardware
+ */
+
+
+static Bool fastAdd(Word x, Word y, Word *resPtr) {
   FP_Union X, Y, Z;
+  int xe, ye, ze;
+  double d;
 
+  xe = (x >> 23) & 0xFF;
+  ye = (y >> 23) & 0xFF;
+  if (xe == 0 || xe == 255 || ye == 0 || ye == 255) {
+    /* zeros and special values */
+    return false;
+  }
+  if (xe - ye > 29 || ye - xe > 29) {
+    /* the sum might not be exact in a double */
+    return false;
+  }
   X.w = x;
   Y.w = y;
-  if (sub) {
-    Z.f = X.f - Y.f;
-  } else {
-    Z.f = X.f + Y.f;
+  d = (double) X.f + (double) Y.f;
+  Z.f = (float) d;
+  if ((double) Z.f != d) {
+    /* the hardware rounds differently */
+    return false;
+  }
+  ze = (Z.w >> 23) & 0xFF;
+  if (Z.w == 0) {
+    /* x = -y, the hardware gives +0 too */
+    *resPtr = 0;
+    return true;
+  }
+  if (ze == 0 || ze == 255) {
+    /* denormal or overflow */
+    return false;
   }
-  return Z.w;
+  if (xe != ye && ze < (xe > ye ? xe : ye)) {
+    /*
+     * cancellation: the hardware rounds the guard bit
+     * of the shifted operand before normalizing
+     */
+    return false;
+  }
+  *resPtr = Z.w;
+  return true;
 }
 
 
-Word fpMul(Word x, Word y) {
+static Bool fastMul(Word x, Word y, Word *resPtr) {
   FP_Union X, Y, Z;
+  DP_Union D;
+  int xe, ye, ze;
+  unsigned long long rest;
 
+  xe = (x >> 23) & 0xFF;
+  ye = (y >> 23) & 0xFF;
+  if (xe == 0 || xe == 255 || ye == 0 || ye == 255) {
+    return false;
+  }
   X.w = x;
   Y.w = y;
-  Z.f = X.f * Y.f;
-  return Z.w;
+  /* exact: 48 product bits fit into a double */
+  D.d = (double) X.f * (double) Y.f;
+  /* bits below the 24 of a float: guard bit and sticky bits */
+  rest = D.l & 0x1FFFFFFF;
+  if (rest == 0x10000000) {
+    /* a tie: the hardware rounds up, the host to even */
+    return false;
+  }
+  Z.f = (float) D.d;
+  ze = (Z.w >> 23) & 0xFF;
+  if (ze < 2 || ze == 255) {
+    /* (nearly) denormal or overflow */
+    return false;
+  }
+  if ((Z.w & 0x007FFFFF) == 0 && rest != 0) {
+    /* rounded up to a power of two: the hardware loses the carry */
+    return false;
+  }
+  *resPtr = Z.w;
+  return true;
 }
 
 
-Word fpDiv(Word x, Word y) {
+static Bool fastDiv(Word x, Word y, Word *resPtr) {
   FP_Union X, Y, Z;
+  int xe, ye, ze;
 
+  xe = (x >> 23) & 0xFF;
+  ye = (y >> 23) & 0xFF;
+  if (xe == 0 || xe == 255 || ye == 0 || ye == 255) {
+    return false;
+  }
   X.w = x;
   Y.w = y;
+  /*
+   * a quotient is never a tie, so rounding to nearest
+   * is the same as the hardware's round half up
+   */
   Z.f = X.f / Y.f;
-  return Z.w;
+  ze = (Z.w >> 23) & 0xFF;
+  if (ze < 2 || ze == 255) {
+    return false;
+  }
+  *resPtr = Z.w;
+  return true;
 }
 
 
-Word fpFlt(Word x) {
+static Bool fastFlt(Word x, Word *resPtr) {
   FP_Union Z;
 
+  if (x + 0x01000000 >= 0x02000000) {
+    /* the hardware only looks at 25 bits */
+    return false;
+  }
   Z.f = (float) (int) x;
-  return Z.w;
+  *resPtr = Z.w;
+  return true;
 }
 
 
-Word fpFlr(Word x) {
+static Bool fastFlr(Word x, Word *resPtr) {
   FP_Union X;
+  int xe;
 
+  xe = (x >> 23) & 0xFF;
+  if (xe == 0 || xe > 150) {
+    /* zeros, denormals, and no fraction left */
+    return false;
+  }
   X.w = x;
-  return (Word) (int) floorf(X.f);
+  *resPtr = (Word) (int) floorf(X.f);
+  return true;
+}
+
+
+/**************************************************************/
+
+/*
+ * one operation: the fast version if possible,
+ * else the model of the hardware
+ */
+
+
+static Word doAdd(Word x, Word y) {
+  Word res;
+
+  if (!exactOnly && fastAdd(x, y, &res)) {
+    fastCount[OP_ADD]++;
+    if (checkFast && res != modelAdd(x, y, false, false)) {
+      error("FAD 0x%08X, 0x%08X: fast 0x%08X, model 0x%08X",
+            x, y, res, modelAdd(x, y, false, false));
+    }
+    return res;
+  }
+  slowCount[OP_ADD]++;
+  return modelAdd(x, y, false, false);
+}
+
+
+static Word doMul(Word x, Word y) {
+  Word res;
+
+  if (!exactOnly && fastMul(x, y, &res)) {
+    fastCount[OP_MUL]++;
+    if (checkFast && res != modelMul(x, y)) {
+      error("FML 0x%08X, 0x%08X: fast 0x%08X, model 0x%08X",
+            x, y, res, modelMul(x, y));
+    }
+    return res;
+  }
+  slowCount[OP_MUL]++;
+  return modelMul(x, y);
+}
+
+
+static Word doDiv(Word x, Word y) {
+  Word res;
+
+  if (!exactOnly && fastDiv(x, y, &res)) {
+    fastCount[OP_DIV]++;
+    if (checkFast && res != modelDiv(x, y)) {
+      error("FDV 0x%08X, 0x%08X: fast 0x%08X, model 0x%08X",
+            x, y, res, modelDiv(x, y));
+    }
+    return res;
+  }
+  slowCount[OP_DIV]++;
+  return modelDiv(x, y);
+}
+
+
+static Word doFlt(Word x) {
+  Word res;
+
+  if (!exactOnly && fastFlt(x, &res)) {
+    fastCount[OP_FLT]++;
+    if (checkFast && res != modelAdd(x, 0x4B000000, true, false)) {
+      error("FLT 0x%08X: fast 0x%08X, model 0x%08X",
+            x, res, modelAdd(x, 0x4B000000, true, false));
+    }
+    return res;
+  }
+  slowCount[OP_FLT]++;
+  return modelAdd(x, 0x4B000000, true, false);
+}
+
+
+static Word doFlr(Word x) {
+  Word res;
+
+  if (!exactOnly && fastFlr(x, &res)) {
+    fastCount[OP_FLR]++;
+    if (checkFast && res != modelAdd(x, 0x4B000000, false, true)) {
+      error("FLR 0x%08X: fast 0x%08X, model 0x%08X",
+            x, res, modelAdd(x, 0x4B000000, false, true));
+    }
+    return res;
+  }
+  slowCount[OP_FLR]++;
+  return modelAdd(x, 0x4B000000, false, true);
+}
+
+
+/**************************************************************/
+
+/*
+ * check the fast versions against the models, and measure
+ * both: all pairs of values with interesting exponents and
+ * mantissas, and a stream of pseudo-random pairs whose
+ * exponents are mostly close to each other
+ */
+
+
+static Word nextRandom(Word *seed) {
+  *seed = *seed * 1664525 + 1013904223;
+  return *seed;
+}
+
+
+static Word randomFloat(Word *seed, int expo) {
+  Word r;
+
+  r = nextRandom(seed);
+  return (r & 0x807FFFFF) | ((expo & 0xFF) << 23);
+}
+
+
+static void checkPair(Word x, Word y) {
+  doAdd(x, y);
+  doAdd(x, y ^ 0x80000000);
+  doMul(x, y);
+  doDiv(x, y);
+  doFlt(x);
+  doFlr(x);
+}
+
+
+static void checkAll(void) {
+  static int expos[] = {
+    0, 1, 2, 3, 23, 24, 25, 62, 63, 64, 100, 125, 126, 127,
+    128, 129, 148, 149, 150, 151, 152, 190, 191, 192, 252,
+    253, 254, 255,
+  };
+  static Word mants[] = {
+    0x000000, 0x000001, 0x000002, 0x000003, 0x3FFFFF, 0x400000,
+    0x400001, 0x555555, 0x7FFFFE, 0x7FFFFF,
+  };
+  Word edge[2 * sizeof(expos) / sizeof(expos[0]) *
+            sizeof(mants) / sizeof(mants[0])];
+  int numEdge;
+  int i, j;
+  Word seed;
+  Word x, y;
+  int e;
+  unsigned long total, slow;
+
+  numEdge = 0;
+  for (i = 0; i < sizeof(expos) / sizeof(expos[0]); i++) {
+    for (j = 0; j < sizeof(mants) / sizeof(mants[0]); j++) {
+      edge[numEdge++] = (expos[i] << 23) | mants[j];
+      edge[numEdge++] = 0x80000000 | (expos[i] << 23) | mants[j];
+    }
+  }
+  for (i = 0; i < numEdge; i++) {
+    for (j = 0; j < numEdge; j++) {
+      checkPair(edge[i], edge[j]);
+    }
+  }
+  for (i = -0x01000010; i < -0x00FFFFF0; i++) {
+    checkPair(i, 0x3F800000);
+    checkPair(-i, 0x3F800000);
+  }
+  seed = 1;
+  for (i = 0; i < 1000000; i++) {
+    e = 64 + nextRandom(&seed) % 128;
+    x = randomFloat(&seed, e);
+    y = randomFloat(&seed, e + (int) (nextRandom(&seed) % 61) - 30);
+    checkPair(x, y);
+    checkPair(nextRandom(&seed) >> (i & 31), y);
+  }
+  total = 0;
+  slow = 0;
+  for (i = 0; i < NUM_OPS; i++) {
+    total += fastCount[i] + slowCount[i];
+    slow += slowCount[i];
+  }
+  printf("FPU check passed: %lu operations, %.1f%% on the slow path\n",
+         total, 100.0 * slow / total);
+}
+
+
+/*
+ * time the same stream of operations, once as usual,
+ * once with the models only
+ */
+static void benchAll(void) {
+  Bool exact, check;
+  int pass;
+  int i;
+  Word seed;
+  Word x, y;
+  int e;
+  Word sum;
+  clock_t start;
+  double secs[2];
+
+  exact = exactOnly;
+  check = checkFast;
+  checkFast = false;
+  for (pass = 0; pass < 2; pass++) {
+    exactOnly = (pass == 1);
+    seed = 1;
+    sum = 0;
+    start = clock();
+    for (i = 0; i < 1000000; i++) {
+      e = 64 + nextRandom(&seed) % 128;
+      x = randomFloat(&seed, e);
+      y = randomFloat(&seed, e + (int) (nextRandom(&seed) % 61) - 30);
+      sum += doAdd(x, y) + doMul(x, y) + doDiv(x, y) +
+             doFlt(nextRandom(&seed) >> 8) + doFlr(x);
+    }
+    secs[pass] = (double) (clock() - start) / CLOCKS_PER_SEC;
+    if (sum == 0x12345678) {
+      /* keep the compiler from dropping the work */
+      printf("!");
+    }
+  }
+  exactOnly = exact;
+  checkFast = check;
+  printf("FPU benchmark: 5M operations, %.3f sec, models only %.3f sec\n",
+         secs[0], secs[1]);
+}
+
+
+/**************************************************************/
+
+
+Word fpAdd(Word x, Word y, Bool sub) {
+  if (sub) {
+    /* the hardware flips the sign of y */
+    y ^= 0x80000000;
+  }
+  return doAdd(x, y);
+}
+
+
+Word fpMul(Word x, Word y) {
+  return doMul(x, y);
+}
+
+
+Word fpDiv(Word x, Word y) {
+  return doDiv(x, y);
+}
+
+
+Word fpFlt(Word x) {
+  return doFlt(x);
+}
+
+
+Word fpFlr(Word x) {
+  return doFlr(x);
 }
 
 
@@ -86,3 +589,41 @@ Word fpGetFlags(void) {
 void fpClrFlags(void) {
   feclearexcept(FE_ALL_EXCEPT);
 }
+
+
+/*
+ * show how many operations of this machine
+ * could not be done with the host's arithmetic
+ */
+void fpStats(void) {
+  static char *names[NUM_OPS] = {
+    "FAD/FSB", "FML", "FDV", "FLT", "FLR",
+  };
+  int i;
+  unsigned long total;
+
+  printf("FPU        fast path   slow path   slow %%\n");
+  for (i = 0; i < NUM_OPS; i++) {
+    total = fastCount[i] + slowCount[i];
+    printf("%-8s %11lu %11lu   %5.1f\n",
+           names[i], fastCount[i], slowCount[i],
+           total == 0 ? 0.0 : 100.0 * slowCount[i] / total);
+  }
+}
+
+
+/*
+ * exact: use the models of the hardware only
+ * check: compare fast results with the models, now for a
+ *        large sample of operands, later for every operation
+ */
+void fpInit(Bool exact, Bool check) {
+  exactOnly = exact;
+  checkFast = check;
+  if (checkFast) {
+    checkAll();
+    benchAll();
+    memset(fastCount, 0, sizeof(fastCount));
+    memset(slowCount, 0, sizeof(slowCount));
+  }
+}
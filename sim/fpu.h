@@ -24,5 +24,8 @@ Word fpFlr(Word x);
 Word fpGetFlags(void);
 void fpClrFlags(void);
 
+void fpStats(void);
+void fpInit(Bool exact, Bool check);
+
 
 #endif /* _FPU_H_ */
@@ -28,6 +28,16 @@ static Bool volatile installed = false;
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#include <X11/keysym.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 
 #define WINDOW_SIZE_X		1024
@@ -42,10 +52,10 @@ static Bool volatile installed = false;
 				 C2B(g, vga.green) | \
 				 C2B(b, vga.blue))
 
-#define B2C(b,ch)		(((((b) / ch.factor) << 8) / ch.scale) & 0xFF)
-#define PIXEL2R(p)		B2C(p, vga.red)
-#define PIXEL2G(p)		B2C(p, vga.green)
-#define PIXEL2B(p)		B2C(p, vga.blue)
+#define BACKGROUND		0x007CD4D6
+#define FOREGROUND		0x00000000
+
+#define COLOR2PIXEL(c)		RGB2PIXEL((c) >> 16, (c) >> 8, (c) >> 0)
 
 
 typedef struct {
@@ -61,20 +71,131 @@ typedef struct {
   Window win;
   GC gc;
   XImage *image;
+  Bool shm;
+  XShmSegmentInfo shmInfo;
   ColorChannel red, green, blue;
-  XExposeEvent expose;
   XClientMessageEvent shutdown;
 } VGA;
 
 
 static VGA vga;
 
+static pthread_mutex_t installLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t installCond = PTHREAD_COND_INITIALIZER;
+
+
+/*
+ * the frame buffer in the same packed 1 bpp layout
+ * as seen by the CPU: bit i of word n is pixel 32*n+i,
+ * lines counted from the bottom, set bits are black;
+ * it is authoritative, the image is derived from it
+ */
+static Word frameBuffer[WINDOW_SIZE_X * WINDOW_SIZE_Y / 32];
+
+
+/*
+ * pixel expansion: pixelTbl[b] is the pixel for bit value b,
+ * expandTbl[n] holds the 8 pixels for the frame buffer byte n;
+ * the table is used if the image has 32-bit pixels in host
+ * byte order (the usual case), else XPutPixel is used
+ */
+static unsigned long pixelTbl[2];
+static Bool fastExpand = false;
+static unsigned int expandTbl[256][8];
+
+
+/*
+ * dirty tiles: bit c of dirtyTiles[r] is set if a pixel
+ * of the tile in column c and row r (both counted in tiles
+ * from the top left corner of the image) has changed since
+ * the tile was last sent to the window
+ */
+#define DIRTY_TILE_X		32
+#define DIRTY_TILE_Y		16
+#define DIRTY_COLS		(WINDOW_SIZE_X / DIRTY_TILE_X)
+#define DIRTY_ROWS		(WINDOW_SIZE_Y / DIRTY_TILE_Y)
+
+static Word dirtyTiles[DIRTY_ROWS];
+
 
 /**************************************************************/
 
 /* monitor server */
 
 
+static void vgaWrite(int x, int y, Word data);
+
+
+/*
+ * the image lives in a shared memory segment if the X server
+ * can attach it (MIT-SHM), else in local memory, from where
+ * every XPutImage copies it over the connection
+ */
+
+static Bool shmFailed;
+
+
+static int shmErrorHandler(Display *display, XErrorEvent *event) {
+  shmFailed = true;
+  return 0;
+}
+
+
+static Bool createShmImage(Visual *visual, int depth) {
+  int (*oldHandler)(Display *, XErrorEvent *);
+
+  if (!XShmQueryExtension(vga.display)) {
+    return false;
+  }
+  vga.image = XShmCreateImage(vga.display, visual, depth, ZPixmap,
+                              NULL, &vga.shmInfo,
+                              WINDOW_SIZE_X, WINDOW_SIZE_Y);
+  if (vga.image == NULL) {
+    return false;
+  }
+  vga.shmInfo.shmid = shmget(IPC_PRIVATE,
+                             vga.image->height * vga.image->bytes_per_line,
+                             IPC_CREAT | 0600);
+  if (vga.shmInfo.shmid < 0) {
+    XDestroyImage(vga.image);
+    return false;
+  }
+  vga.shmInfo.shmaddr = shmat(vga.shmInfo.shmid, NULL, 0);
+  if (vga.shmInfo.shmaddr == (char *) -1) {
+    shmctl(vga.shmInfo.shmid, IPC_RMID, NULL);
+    XDestroyImage(vga.image);
+    return false;
+  }
+  vga.image->data = vga.shmInfo.shmaddr;
+  vga.shmInfo.readOnly = False;
+  /* a remote server fails asynchronously, so catch its error */
+  shmFailed = false;
+  oldHandler = XSetErrorHandler(shmErrorHandler);
+  XShmAttach(vga.display, &vga.shmInfo);
+  XSync(vga.display, False);
+  XSetErrorHandler(oldHandler);
+  /* the segment goes away when both sides have detached */
+  shmctl(vga.shmInfo.shmid, IPC_RMID, NULL);
+  if (shmFailed) {
+    shmdt(vga.shmInfo.shmaddr);
+    XDestroyImage(vga.image);
+    return false;
+  }
+  return true;
+}
+
+
+static void putImage(int x, int y, int width, int height) {
+  if (vga.shm) {
+    XShmPutImage(vga.display, vga.win, vga.gc, vga.image,
+                 x, y, x, y, width, height, False);
+  } else {
+    XPutImage(vga.display, vga.win, vga.gc, vga.image,
+              x, y, x, y, width, height);
+  }
+}
+
+
 static ColorChannel mask2channel(unsigned long mask) {
   unsigned long f;
   ColorChannel ch;
@@ -120,8 +241,8 @@ static void initMonitor(int argc, char *argv[]) {
   int bestMatch;
   int bestDepth;
   Visual *visual;
-  int i;
-  unsigned long pixel;
+  int i, j;
+  int hostOrder;
   int x, y;
   Colormap colormap;
   XSetWindowAttributes attrib;
@@ -164,20 +285,36 @@ static void initMonitor(int argc, char *argv[]) {
   vga.red = mask2channel(visualInfo[bestMatch].red_mask);
   vga.green = mask2channel(visualInfo[bestMatch].green_mask);
   vga.blue = mask2channel(visualInfo[bestMatch].blue_mask);
-  /* create and initialize image */
-  vga.image = XCreateImage(vga.display, visual, bestDepth, ZPixmap,
-                           0, NULL, WINDOW_SIZE_X, WINDOW_SIZE_Y, 32, 0);
-  if (vga.image == NULL) {
-    error("cannot allocate image");
+  /* create image, shared with the server if possible */
+  vga.shm = createShmImage(visual, bestDepth);
+  if (!vga.shm) {
+    vga.image = XCreateImage(vga.display, visual, bestDepth, ZPixmap,
+                             0, NULL, WINDOW_SIZE_X, WINDOW_SIZE_Y, 32, 0);
+    if (vga.image == NULL) {
+      error("cannot allocate image");
+    }
+    vga.image->data = malloc(vga.image->height * vga.image->bytes_per_line);
+    if (vga.image->data == NULL) {
+      error("cannot allocate image memory");
+    }
   }
-  vga.image->data = malloc(vga.image->height * vga.image->bytes_per_line);
-  if (vga.image->data == NULL) {
-    error("cannot allocate image memory");
+  /* build pixel expansion tables */
+  pixelTbl[0] = COLOR2PIXEL(BACKGROUND);
+  pixelTbl[1] = COLOR2PIXEL(FOREGROUND);
+  hostOrder = 1;
+  fastExpand = vga.image->bits_per_pixel == 32 &&
+               vga.image->byte_order ==
+                 (*(char *) &hostOrder ? LSBFirst : MSBFirst);
+  for (i = 0; i < 256; i++) {
+    for (j = 0; j < 8; j++) {
+      expandTbl[i][j] = pixelTbl[(i >> j) & 1];
+    }
   }
-  pixel = RGB2PIXEL(0, 0, 0);
+  /* initialize image from frame buffer */
   for (y = 0; y < WINDOW_SIZE_Y; y++) {
-    for (x = 0; x < WINDOW_SIZE_X; x++) {
-      XPutPixel(vga.image, x, y, pixel);
+    for (x = 0; x < WINDOW_SIZE_X; x += 32) {
+      vgaWrite(x, y, frameBuffer[((WINDOW_SIZE_Y - 1 - y) *
+                                  WINDOW_SIZE_X + x) >> 5]);
     }
   }
   /* allocate a colormap */
@@ -188,7 +325,7 @@ static void initMonitor(int argc, char *argv[]) {
                       PointerMotionMask |
                       ButtonPressMask | ButtonReleaseMask |
                       KeyPressMask | KeyReleaseMask;
-  attrib.background_pixel = RGB2PIXEL(0, 0, 0);
+  attrib.background_pixel = pixelTbl[0];
   attrib.border_pixel = RGB2PIXEL(0, 0, 0);
   vga.win =
     XCreateWindow(vga.display, rootWin,
@@ -228,15 +365,6 @@ static void initMonitor(int argc, char *argv[]) {
                 makeBlankCursor(vga.display, vga.win));
   /* finally get the window displayed */
   XMapWindow(vga.display, vga.win);
-  /* prepare expose event */
-  vga.expose.type = Expose;
-  vga.expose.display = vga.display;
-  vga.expose.window = vga.win;
-  vga.expose.x = 0;
-  vga.expose.y = 0;
-  vga.expose.width = WINDOW_SIZE_X;
-  vga.expose.height = WINDOW_SIZE_Y;
-  vga.expose.count = 0;
   /* prepare shutdown event */
   vga.shutdown.type = ClientMessage;
   vga.shutdown.display = vga.display;
@@ -245,7 +373,10 @@ static void initMonitor(int argc, char *argv[]) {
   vga.shutdown.format = 8;
   /* say that the graphics controller is installed */
   XSync(vga.display, False);
+  pthread_mutex_lock(&installLock);
   installed = true;
+  pthread_cond_signal(&installCond);
+  pthread_mutex_unlock(&installLock);
 }
 
 
@@ -253,7 +384,14 @@ static void exitMonitor(void) {
   XFreeGC(vga.display, vga.gc);
   XUnmapWindow(vga.display, vga.win);
   XDestroyWindow(vga.display, vga.win);
-  XDestroyImage(vga.image);
+  if (vga.shm) {
+    XShmDetach(vga.display, &vga.shmInfo);
+    XSync(vga.display, False);
+    XDestroyImage(vga.image);
+    shmdt(vga.shmInfo.shmaddr);
+  } else {
+    XDestroyImage(vga.image);
+  }
   XCloseDisplay(vga.display);
   installed = false;
 }
@@ -284,10 +422,8 @@ static void *server(void *ignore) {
     XNextEvent(vga.display, &event);
     switch (event.type) {
       case Expose:
-        XPutImage(vga.display, vga.win, vga.gc, vga.image,
-                  event.xexpose.x, event.xexpose.y,
-                  event.xexpose.x, event.xexpose.y,
-                  event.xexpose.width, event.xexpose.height);
+        putImage(event.xexpose.x, event.xexpose.y,
+                 event.xexpose.width, event.xexpose.height);
         break;
       case ClientMessage:
         if (event.xclient.message_type == XA_WM_COMMAND &&
@@ -327,12 +463,73 @@ static void *server(void *ignore) {
 static Bool volatile refreshRunning = false;
 
 
+/*
+ * hand the dirty tiles to send(), one row of tiles at a time:
+ * runs of dirty tiles in a row form rectangles, and a rectangle
+ * grows downwards as long as the next row has a run with exactly
+ * the same columns; send() is not called at all if no tile is
+ * dirty, and the result tells whether it was called
+ */
+static Bool takeDirty(void (*send)(int x, int y, int width, int height)) {
+  int open[DIRTY_COLS];		/* first row of rectangle, or -1 */
+  int openEnd[DIRTY_COLS];	/* first column after rectangle */
+  Word dirty;
+  int row, col, end, c;
+  Bool sent;
+
+  for (col = 0; col < DIRTY_COLS; col++) {
+    open[col] = -1;
+  }
+  sent = false;
+  /* an extra clean row at the end closes all rectangles */
+  for (row = 0; row <= DIRTY_ROWS; row++) {
+    dirty = 0;
+    if (row < DIRTY_ROWS &&
+        __atomic_load_n(&dirtyTiles[row], __ATOMIC_RELAXED) != 0) {
+      dirty = __atomic_exchange_n(&dirtyTiles[row], 0, __ATOMIC_ACQUIRE);
+    }
+    col = 0;
+    while (col < DIRTY_COLS) {
+      /* the run starting at col, empty if col is clean */
+      end = col;
+      while (end < DIRTY_COLS && (dirty & ((Word) 1 << end)) != 0) {
+        end++;
+      }
+      if (end > col && open[col] >= 0 && openEnd[col] == end) {
+        /* same columns as in the row above: grow */
+        col = end;
+        continue;
+      }
+      /* close what starts within the run, open a new one */
+      for (c = col; c < end || c == col; c++) {
+        if (open[c] >= 0) {
+          send(c * DIRTY_TILE_X, open[c] * DIRTY_TILE_Y,
+               (openEnd[c] - c) * DIRTY_TILE_X,
+               (row - open[c]) * DIRTY_TILE_Y);
+          open[c] = -1;
+          sent = true;
+        }
+      }
+      if (end > col) {
+        open[col] = row;
+        openEnd[col] = end;
+        col = end;
+      } else {
+        col++;
+      }
+    }
+  }
+  return sent;
+}
+
+
 static void *refresh(void *ignore) {
   struct timespec delay;
 
   while (refreshRunning) {
-    XSendEvent(vga.display, vga.win, False, 0, (XEvent *) &vga.expose);
-    XFlush(vga.display);
+    if (takeDirty(putImage)) {
+      XFlush(vga.display);
+    }
     delay.tv_sec = 0;
     delay.tv_nsec = 20 * 1000 * 1000;
     nanosleep(&delay, &delay);
@@ -341,6 +538,664 @@ static void *refresh(void *ignore) {
 }
 
 
+/**************************************************************/
+
+/* RFB (VNC) server, instead of a window on an X server */
+
+
+/*
+ * With an RFB port set, no X server is contacted. The frame
+ * buffer is served to one VNC viewer at a time on that TCP
+ * port of the loopback interface; there is no authentication,
+ * so a viewer elsewhere should come in through an ssh tunnel.
+ * Changed tiles are sent as raw or RRE rectangles, whichever
+ * is smaller, and pointer and key events from the viewer take
+ * the same path as those from an X window.
+ */
+
+
+#define RFB_NAME		"RISC5"
+#define RFB_TIMEOUT		5	/* sec, for a stalled viewer */
+#define RFB_MAX_RECTS		(DIRTY_COLS * DIRTY_ROWS)
+
+
+static int rfbPort = 0;		/* 0 means use the X server */
+static int rfbListen = -1;
+static int volatile rfbClient = -1;
+static pthread_t rfbThread;
+static Bool volatile rfbRunning = false;
+
+/* the viewer's wishes */
+static int rfbBpp;		/* bytes per pixel */
+static Byte rfbPixel[2][4];	/* pixels for bit values 0 and 1 */
+static Bool rfbRRE;		/* RRE encoding accepted */
+static Bool rfbWanted;		/* an update has been requested */
+static Bool rfbWantedFull;	/* ... of the area below, not only changes */
+static int rfbWantedX, rfbWantedY, rfbWantedW, rfbWantedH;
+static int rfbButtons;		/* last button mask */
+
+/* dirty rectangles taken for the next update */
+static int rfbRects[RFB_MAX_RECTS][4];
+static int rfbNumRects;
+
+/* the message being built */
+static Byte *rfbBuf = NULL;
+static int rfbLen;
+static int rfbSize = 0;
+
+
+/*
+ * X keysyms as sent by the viewer, mapped to the keycodes
+ * of an X server with the evdev driver, which is what the
+ * keycode table expects; shifted symbols map to their key
+ * on a US keyboard, as the viewer sends the shift key, too
+ */
+static struct {
+  KeySym keysym;
+  unsigned int xKeycode;
+} keysymTbl[] = {
+  { XK_Escape, 0x09 },
+  { XK_F1, 0x43 }, { XK_F2, 0x44 }, { XK_F3, 0x45 }, { XK_F4, 0x46 },
+  { XK_F5, 0x47 }, { XK_F6, 0x48 }, { XK_F7, 0x49 }, { XK_F8, 0x4A },
+  { XK_F9, 0x4B }, { XK_F10, 0x4C }, { XK_F11, 0x5F }, { XK_F12, 0x60 },
+  /*------------------------------------------------*/
+  { XK_grave, 0x31 }, { XK_asciitilde, 0x31 },
+  { XK_1, 0x0A }, { XK_exclam, 0x0A },
+  { XK_2, 0x0B }, { XK_at, 0x0B },
+  { XK_3, 0x0C }, { XK_numbersign, 0x0C },
+  { XK_4, 0x0D }, { XK_dollar, 0x0D },
+  { XK_5, 0x0E }, { XK_percent, 0x0E },
+  { XK_6, 0x0F }, { XK_asciicircum, 0x0F },
+  { XK_7, 0x10 }, { XK_ampersand, 0x10 },
+  { XK_8, 0x11 }, { XK_asterisk, 0x11 },
+  { XK_9, 0x12 }, { XK_parenleft, 0x12 },
+  { XK_0, 0x13 }, { XK_parenright, 0x13 },
+  { XK_minus, 0x14 }, { XK_underscore, 0x14 },
+  { XK_equal, 0x15 }, { XK_plus, 0x15 },
+  { XK_BackSpace, 0x16 },
+  /*------------------------------------------------*/
+  { XK_Tab, 0x17 }, { XK_ISO_Left_Tab, 0x17 },
+  { XK_q, 0x18 }, { XK_w, 0x19 }, { XK_e, 0x1A }, { XK_r, 0x1B },
+  { XK_t, 0x1C }, { XK_y, 0x1D }, { XK_u, 0x1E }, { XK_i, 0x1F },
+  { XK_o, 0x20 }, { XK_p, 0x21 },
+  { XK_bracketleft, 0x22 }, { XK_braceleft, 0x22 },
+  { XK_bracketright, 0x23 }, { XK_braceright, 0x23 },
+  { XK_Return, 0x24 }, { XK_Scroll_Lock, 0x4E },
+  /*------------------------------------------------*/
+  { XK_Caps_Lock, 0x42 },
+  { XK_a, 0x26 }, { XK_s, 0x27 }, { XK_d, 0x28 }, { XK_f, 0x29 },
+  { XK_g, 0x2A }, { XK_h, 0x2B }, { XK_j, 0x2C }, { XK_k, 0x2D },
+  { XK_l, 0x2E },
+  { XK_semicolon, 0x2F }, { XK_colon, 0x2F },
+  { XK_apostrophe, 0x30 }, { XK_quotedbl, 0x30 },
+  { XK_backslash, 0x33 }, { XK_bar, 0x33 },
+  /*------------------------------------------------*/
+  { XK_Shift_L, 0x32 },
+  { XK_z, 0x34 }, { XK_x, 0x35 }, { XK_c, 0x36 }, { XK_v, 0x37 },
+  { XK_b, 0x38 }, { XK_n, 0x39 }, { XK_m, 0x3A },
+  { XK_comma, 0x3B }, { XK_less, 0x3B },
+  { XK_period, 0x3C }, { XK_greater, 0x3C },
+  { XK_slash, 0x3D }, { XK_question, 0x3D },
+  { XK_Shift_R, 0x3E },
+  /*------------------------------------------------*/
+  { XK_Control_L, 0x25 }, { XK_Super_L, 0x85 },
+  { XK_Alt_L, 0x40 }, { XK_Meta_L, 0x40 }, { XK_space, 0x41 },
+  { XK_Alt_R, 0x6C }, { XK_ISO_Level3_Shift, 0x6C },
+  { XK_Super_R, 0x86 }, { XK_Menu, 0x87 }, { XK_Control_R, 0x6D },
+  /*------------------------------------------------*/
+  { XK_Insert, 0x76 }, { XK_Home, 0x6E }, { XK_Prior, 0x70 },
+  { XK_Delete, 0x77 }, { XK_End, 0x73 }, { XK_Next, 0x75 },
+  { XK_Up, 0x6F }, { XK_Left, 0x71 }, { XK_Down, 0x74 }, { XK_Right, 0x72 },
+  /*------------------------------------------------*/
+  { XK_Num_Lock, 0x4D }, { XK_KP_Divide, 0x6A },
+  { XK_KP_Multiply, 0x3F }, { XK_KP_Subtract, 0x52 },
+  { XK_KP_7, 0x4F }, { XK_KP_Home, 0x4F },
+  { XK_KP_8, 0x50 }, { XK_KP_Up, 0x50 },
+  { XK_KP_9, 0x51 }, { XK_KP_Prior, 0x51 },
+  { XK_KP_Add, 0x56 },
+  { XK_KP_4, 0x53 }, { XK_KP_Left, 0x53 },
+  { XK_KP_5, 0x54 }, { XK_KP_Begin, 0x54 },
+  { XK_KP_6, 0x55 }, { XK_KP_Right, 0x55 },
+  { XK_KP_1, 0x57 }, { XK_KP_End, 0x57 },
+  { XK_KP_2, 0x58 }, { XK_KP_Down, 0x58 },
+  { XK_KP_3, 0x59 }, { XK_KP_Next, 0x59 },
+  { XK_KP_Enter, 0x68 },
+  { XK_KP_0, 0x5A }, { XK_KP_Insert, 0x5A },
+  { XK_KP_Decimal, 0x5B }, { XK_KP_Delete, 0x5B },
+};
+
+
+static unsigned int keysym2keycode(KeySym keysym) {
+  int i;
+
+  if (keysym >= XK_A && keysym <= XK_Z) {
+    keysym += XK_a - XK_A;
+  }
+  for (i = 0; i < sizeof(keysymTbl) / sizeof(keysymTbl[0]); i++) {
+    if (keysymTbl[i].keysym == keysym) {
+      return keysymTbl[i].xKeycode;
+    }
+  }
+  return 0;
+}
+
+
+static void rfbPut(void *data, int n) {
+  if (rfbLen + n > rfbSize) {
+    rfbSize = 2 * (rfbLen + n);
+    rfbBuf = realloc(rfbBuf, rfbSize);
+    if (rfbBuf == NULL) {
+      error("cannot allocate RFB buffer");
+    }
+  }
+  memcpy(rfbBuf + rfbLen, data, n);
+  rfbLen += n;
+}
+
+
+static void rfbPut8(int x) {
+  Byte b;
+
+  b = x;
+  rfbPut(&b, 1);
+}
+
+
+static void rfbPut16(int x) {
+  rfbPut8(x >> 8);
+  rfbPut8(x);
+}
+
+
+static void rfbPut32(Word x) {
+  rfbPut16(x >> 16);
+  rfbPut16(x);
+}
+
+
+/*
+ * send the message built so far, which is then empty again
+ */
+static Bool rfbFlush(void) {
+  int done, res;
+
+  for (done = 0; done < rfbLen; done += res) {
+    res = send(rfbClient, rfbBuf + done, rfbLen - done, MSG_NOSIGNAL);
+    if (res < 0 && errno == EINTR) {
+      res = 0;
+      continue;
+    }
+    if (res <= 0) {
+      return false;
+    }
+  }
+  rfbLen = 0;
+  return true;
+}
+
+
+static Bool rfbRecv(void *data, int n) {
+  int done, res;
+
+  for (done = 0; done < n; done += res) {
+    res = recv(rfbClient, (Byte *) data + done, n - done, 0);
+    if (res < 0 && errno == EINTR) {
+      res = 0;
+      continue;
+    }
+    if (res <= 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+static Word get16(Byte *p) {
+  return (Word) p[0] << 8 | p[1];
+}
+
+
+static Word get32(Byte *p) {
+  return get16(p) << 16 | get16(p + 2);
+}
+
+
+/*
+ * adopt the pixel format the viewer asks for: true color
+ * in 8, 16 or 32 bits, or a color map, in which case
+ * indices 0 and 1 are loaded with our two colors
+ */
+static Bool rfbSetPixelFormat(Byte *fmt) {
+  Word colors[2];
+  Word pixel, r, g, b;
+  Word limit;
+  int i, j;
+
+  if (fmt[0] != 8 && fmt[0] != 16 && fmt[0] != 32) {
+    return false;
+  }
+  if (fmt[3] != 0) {
+    /* every channel must fit into the pixel: no shift >= bpp */
+    limit = fmt[0] == 32 ? 0xFFFFFFFF : ((Word) 1 << fmt[0]) - 1;
+    for (i = 0; i < 3; i++) {
+      if (fmt[10 + i] >= fmt[0] ||
+          get16(fmt + 4 + 2 * i) > limit >> fmt[10 + i]) {
+        return false;
+      }
+    }
+  }
+  rfbBpp = fmt[0] / 8;
+  colors[0] = BACKGROUND;
+  colors[1] = FOREGROUND;
+  for (i = 0; i < 2; i++) {
+    if (fmt[3] != 0) {
+      /* true color: scale to maximum, then shift */
+      r = ((colors[i] >> 16) & 0xFF) * get16(fmt + 4) / 0xFF;
+      g = ((colors[i] >>  8) & 0xFF) * get16(fmt + 6) / 0xFF;
+      b = ((colors[i] >>  0) & 0xFF) * get16(fmt + 8) / 0xFF;
+      pixel = r << fmt[10] | g << fmt[11] | b << fmt[12];
+    } else {
+      pixel = i;
+    }
+    for (j = 0; j < rfbBpp; j++) {
+      rfbPixel[i][j] = pixel >> 8 * (fmt[2] != 0 ? rfbBpp - 1 - j : j);
+    }
+  }
+  if (fmt[3] == 0) {
+    /* SetColourMapEntries */
+    rfbPut8(1);
+    rfbPut8(0);
+    rfbPut16(0);
+    rfbPut16(2);
+    for (i = 0; i < 2; i++) {
+      rfbPut16(((colors[i] >> 16) & 0xFF) * 0x101);
+      rfbPut16(((colors[i] >>  8) & 0xFF) * 0x101);
+      rfbPut16(((colors[i] >>  0) & 0xFF) * 0x101);
+    }
+    return rfbFlush();
+  }
+  return true;
+}
+
+
+/*
+ * pixel (x, y), counted from the top left corner,
+ * read from the frame buffer: 1 if set (black)
+ */
+static int rfbBit(int x, int y) {
+  int n;
+
+  n = (WINDOW_SIZE_Y - 1 - y) * WINDOW_SIZE_X + x;
+  return (frameBuffer[n >> 5] >> (n & 31)) & 1;
+}
+
+
+/*
+ * put one rectangle: in RRE, the set pixels of each line
+ * are subrectangles on the background, which pays off as
+ * long as they are few; else the pixels are sent raw
+ */
+static void rfbPutRect(int x, int y, int width, int height) {
+  int subRects;
+  int i, j, k;
+
+  rfbPut16(x);
+  rfbPut16(y);
+  rfbPut16(width);
+  rfbPut16(height);
+  subRects = 0;
+  if (rfbRRE) {
+    for (j = 0; j < height; j++) {
+      for (i = 0; i < width; i++) {
+        if (rfbBit(x + i, y + j) &&
+            (i == 0 || !rfbBit(x + i - 1, y + j))) {
+          subRects++;
+        }
+      }
+    }
+  }
+  if (rfbRRE &&
+      4 + rfbBpp + subRects * (rfbBpp + 8) < width * height * rfbBpp) {
+    rfbPut32(2);
+    rfbPut32(subRects);
+    rfbPut(rfbPixel[0], rfbBpp);
+    for (j = 0; j < height; j++) {
+      for (i = 0; i < width; i = k) {
+        for (k = i; k < width && rfbBit(x + k, y + j); k++) ;
+        if (k == i) {
+          k++;
+          continue;
+        }
+        rfbPut(rfbPixel[1], rfbBpp);
+        rfbPut16(i);
+        rfbPut16(j);
+        rfbPut16(k - i);
+        rfbPut16(1);
+      }
+    }
+  } else {
+    rfbPut32(0);
+    for (j = 0; j < height; j++) {
+      for (i = 0; i < width; i++) {
+        rfbPut(rfbPixel[rfbBit(x + i, y + j)], rfbBpp);
+      }
+    }
+  }
+}
+
+
+static void rfbTakeRect(int x, int y, int width, int height) {
+  rfbRects[rfbNumRects][0] = x;
+  rfbRects[rfbNumRects][1] = y;
+  rfbRects[rfbNumRects][2] = width;
+  rfbRects[rfbNumRects][3] = height;
+  rfbNumRects++;
+}
+
+
+/*
+ * answer an update request: a full one at once, one for
+ * changes only as soon as there are any
+ */
+static Bool rfbUpdate(void) {
+  int i;
+
+  rfbNumRects = 0;
+  if (rfbWantedFull) {
+    rfbTakeRect(rfbWantedX, rfbWantedY, rfbWantedW, rfbWantedH);
+  } else if (!takeDirty(rfbTakeRect)) {
+    return true;
+  }
+  rfbPut8(0);
+  rfbPut8(0);
+  rfbPut16(rfbNumRects);
+  for (i = 0; i < rfbNumRects; i++) {
+    rfbPutRect(rfbRects[i][0], rfbRects[i][1],
+               rfbRects[i][2], rfbRects[i][3]);
+  }
+  rfbWanted = false;
+  return rfbFlush();
+}
+
+
+/*
+ * protocol version, security type "None",
+ * client and server initialization
+ */
+static Bool rfbHandshake(void) {
+  static Byte format[16] = {
+    32, 24, 0, 1, 0x00, 0xFF, 0x00, 0xFF, 0x00, 0xFF, 16, 8, 0, 0, 0, 0
+  };
+  char version[13];
+  int minor;
+  Byte b;
+
+  rfbLen = 0;
+  rfbPut("RFB 003.008\n", 12);
+  if (!rfbFlush() || !rfbRecv(version, 12)) {
+    return false;
+  }
+  version[12] = '\0';
+  if (sscanf(version, "RFB 003.%03d\n", &minor) != 1) {
+    return false;
+  }
+  if (minor >= 7) {
+    rfbPut8(1);
+    rfbPut8(1);
+    if (!rfbFlush() || !rfbRecv(&b, 1) || b != 1) {
+      return false;
+    }
+    if (minor >= 8) {
+      rfbPut32(0);
+    }
+  } else {
+    rfbPut32(1);
+  }
+  /* the shared flag is ignored, there is one viewer only */
+  if (!rfbFlush() || !rfbRecv(&b, 1)) {
+    return false;
+  }
+  rfbPut16(WINDOW_SIZE_X);
+  rfbPut16(WINDOW_SIZE_Y);
+  rfbPut(format, 16);
+  rfbPut32(strlen(RFB_NAME));
+  rfbPut(RFB_NAME, strlen(RFB_NAME));
+  if (!rfbFlush()) {
+    return false;
+  }
+  rfbRRE = false;
+  rfbWanted = false;
+  rfbButtons = 0;
+  return rfbSetPixelFormat(format);
+}
+
+
+/*
+ * receive and act on one message from the viewer
+ */
+static Bool rfbMessage(void) {
+  Byte msg[20];
+  int n, i;
+  int x, y;
+
+  if (!rfbRecv(msg, 1)) {
+    return false;
+  }
+  switch (msg[0]) {
+    case 0:
+      /* SetPixelFormat */
+      if (!rfbRecv(msg, 19)) {
+        return false;
+      }
+      return rfbSetPixelFormat(msg + 3);
+    case 2:
+      /* SetEncodings */
+      if (!rfbRecv(msg, 3)) {
+        return false;
+      }
+      n = get16(msg + 1);
+      rfbRRE = false;
+      for (i = 0; i < n; i++) {
+        if (!rfbRecv(msg, 4)) {
+          return false;
+        }
+        if (get32(msg) == 2) {
+          rfbRRE = true;
+        }
+      }
+      return true;
+    case 3:
+      /* FramebufferUpdateRequest */
+      if (!rfbRecv(msg, 9)) {
+        return false;
+      }
+      x = get16(msg + 1);
+      y = get16(msg + 3);
+      if (x >= WINDOW_SIZE_X || y >= WINDOW_SIZE_Y) {
+        return false;
+      }
+      if (msg[0] == 0) {
+        rfbWantedFull = true;
+        rfbWantedX = x;
+        rfbWantedY = y;
+        rfbWantedW = get16(msg + 5);
+        rfbWantedH = get16(msg + 7);
+        if (rfbWantedW > WINDOW_SIZE_X - x) {
+          rfbWantedW = WINDOW_SIZE_X - x;
+        }
+        if (rfbWantedH > WINDOW_SIZE_Y - y) {
+          rfbWantedH = WINDOW_SIZE_Y - y;
+        }
+      } else if (!rfbWanted) {
+        rfbWantedFull = false;
+      }
+      rfbWanted = true;
+      return true;
+    case 4:
+      /* KeyEvent */
+      if (!rfbRecv(msg, 7)) {
+        return false;
+      }
+      i = keysym2keycode(get32(msg + 3));
+      if (i != 0) {
+        if (msg[0] != 0) {
+          doKeyPress(i);
+        } else {
+          doKeyRelease(i);
+        }
+      }
+      return true;
+    case 5:
+      /* PointerEvent: buttons 1..3 are mask bits 0..2 */
+      if (!rfbRecv(msg, 5)) {
+        return false;
+      }
+      x = get16(msg + 1);
+      y = get16(msg + 3);
+      if (x < WINDOW_SIZE_X && y < WINDOW_SIZE_Y) {
+        doMouseMove(x, y);
+      }
+      for (i = 0; i < 3; i++) {
+        if (((msg[0] ^ rfbButtons) & (1 << i)) != 0) {
+          if ((msg[0] & (1 << i)) != 0) {
+            doButtonPress(i + 1);
+          } else {
+            doButtonRelease(i + 1);
+          }
+        }
+      }
+      rfbButtons = msg[0];
+      return true;
+    case 6:
+      /* ClientCutText, ignored */
+      if (!rfbRecv(msg, 7)) {
+        return false;
+      }
+      for (n = get32(msg + 3); n > 0; n -= i) {
+        i = n < sizeof(msg) ? n : sizeof(msg);
+        if (!rfbRecv(msg, i)) {
+          return false;
+        }
+      }
+      return true;
+    default:
+      if (debug) {
+        printf("\n**** RFB: unknown message type %d ****\n", msg[0]);
+      }
+      return false;
+  }
+}
+
+
+static void rfbClose(void) {
+  int i;
+
+  close(rfbClient);
+  rfbClient = -1;
+  /* let go of the buttons the viewer left pressed */
+  for (i = 0; i < 3; i++) {
+    if ((rfbButtons & (1 << i)) != 0) {
+      doButtonRelease(i + 1);
+    }
+  }
+  rfbButtons = 0;
+}
+
+
+static void *rfbServer(void *ignore) {
+  struct pollfd fds[2];
+  struct timeval timeout;
+  int one;
+  int fd;
+
+  while (rfbRunning) {
+    fds[0].fd = rfbListen;
+    fds[0].events = POLLIN;
+    fds[1].fd = rfbClient;
+    fds[1].events = POLLIN;
+    /* wait for changes as long as the refresh timer would */
+    if (poll(fds, 2, 20) < 0) {
+      continue;
+    }
+    if ((fds[0].revents & POLLIN) != 0) {
+      fd = accept(rfbListen, NULL, NULL);
+      if (fd >= 0 && rfbClient >= 0) {
+        /* busy with another viewer */
+        close(fd);
+      } else if (fd >= 0) {
+        rfbClient = fd;
+        one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        timeout.tv_sec = RFB_TIMEOUT;
+        timeout.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (!rfbHandshake()) {
+          rfbClose();
+        }
+      }
+    }
+    if (rfbClient >= 0 && (fds[1].revents & (POLLIN | POLLHUP)) != 0) {
+      if (!rfbMessage()) {
+        rfbClose();
+      }
+    }
+    if (rfbClient >= 0 && rfbWanted) {
+      if (!rfbUpdate()) {
+        rfbClose();
+      }
+    }
+  }
+  if (rfbClient >= 0) {
+    rfbClose();
+  }
+  return NULL;
+}
+
+
+static void rfbInit(void) {
+  struct sockaddr_in addr;
+  int one;
+
+  rfbListen = socket(AF_INET, SOCK_STREAM, 0);
+  if (rfbListen < 0) {
+    error("cannot create RFB socket");
+  }
+  one = 1;
+  setsockopt(rfbListen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(rfbPort);
+  if (bind(rfbListen, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(rfbListen, 1) < 0) {
+    error("cannot listen on RFB port %d", rfbPort);
+  }
+  printf("Display served by RFB on localhost:%d\n", rfbPort);
+  installed = true;
+  rfbRunning = true;
+  if (pthread_create(&rfbThread, NULL, rfbServer, NULL) != 0) {
+    error("cannot start RFB server");
+  }
+}
+
+
+static void rfbExit(void) {
+  int fd;
+
+  rfbRunning = false;
+  /* wake the server if it waits for a viewer */
+  fd = rfbClient;
+  if (fd >= 0) {
+    shutdown(fd, SHUT_RDWR);
+  }
+  pthread_join(rfbThread, NULL);
+  close(rfbListen);
+  installed = false;
+}
+
+
 /**************************************************************/
 
 /* server interface */
@@ -357,13 +1212,21 @@ static pthread_t refreshThread;
 
 
 static void vgaInit(void) {
+  if (rfbPort != 0) {
+    rfbInit();
+    return;
+  }
   /* start monitor server in a separate thread */
   vga.argc = myArgc;
   vga.argv = myArgv;
   if (pthread_create(&monitorThread, NULL, server, NULL) != 0) {
     error("cannot start monitor server");
   }
-  while (!installed) ;
+  pthread_mutex_lock(&installLock);
+  while (!installed) {
+    pthread_cond_wait(&installCond, &installLock);
+  }
+  pthread_mutex_unlock(&installLock);
   /* start refresh timer in another thread */
   refreshRunning = true;
   if (pthread_create(&refreshThread, NULL, refresh, NULL) != 0) {
@@ -373,6 +1236,10 @@ static void vgaInit(void) {
 
 
 static void vgaExit(void) {
+  if (rfbPort != 0) {
+    rfbExit();
+    return;
+  }
   refreshRunning = false;
   pthread_join(refreshThread, NULL);
   XSendEvent(vga.display, vga.win, False, 0, (XEvent *) &vga.shutdown);
@@ -381,18 +1248,27 @@ static void vgaExit(void) {
 }
 
 
-static void vgaWrite(int x, int y, int r, int g, int b) {
-  XPutPixel(vga.image, x, y, RGB2PIXEL(r, g, b));
-}
-
-
-static void vgaRead(int x, int y, int *r, int *g, int *b) {
-  unsigned long pixel;
+/*
+ * expand one frame buffer word into the 32 pixels
+ * starting at (x, y) in the image
+ */
+static void vgaWrite(int x, int y, Word data) {
+  unsigned int *p;
+  int i;
 
-  pixel = XGetPixel(vga.image, x, y);
-  *r = PIXEL2R(pixel);
-  *g = PIXEL2G(pixel);
-  *b = PIXEL2B(pixel);
+  if (fastExpand) {
+    p = (unsigned int *)
+          (vga.image->data + y * vga.image->bytes_per_line) + x;
+    for (i = 0; i < 4; i++) {
+      memcpy(p, expandTbl[data & 0xFF], sizeof(expandTbl[0]));
+      p += 8;
+      data >>= 8;
+    }
+  } else {
+    for (i = 0; i < 32; i++) {
+      XPutPixel(vga.image, x + i, y, pixelTbl[(data >> i) & 1]);
+    }
+  }
 }
 
 
@@ -402,38 +1278,16 @@ static void vgaRead(int x, int y, int *r, int *g, int *b) {
 /* graphics device interface */
 
 
-#define BACKGROUND	0x007CD4D6
-#define FOREGROUND	0x00000000
-
-
 Word graphRead(Word addr) {
-  int x, y;
-  int i;
-  int r, g, b;
   Word data;
 
   if (debug) {
     printf("\n**** GRAPH READ from 0x%08X", addr);
   }
-  if (!installed) {
-    return 0;
-  }
   if (addr >= WINDOW_SIZE_X * WINDOW_SIZE_Y / 32) {
     return 0;
   }
-  /* read pixels from frame buffer memory */
-  addr <<= 5;
-  x = addr % WINDOW_SIZE_X;
-  y = WINDOW_SIZE_Y - 1 - addr / WINDOW_SIZE_X;
-  data = 0;
-  for (i = 0; i < 32; i++) {
-    vgaRead(x + i, y, &r, &g, &b);
-    if (r == ((FOREGROUND >> 16) & 0xFF) &&
-        g == ((FOREGROUND >>  8) & 0xFF) &&
-        b == ((FOREGROUND >>  0) & 0xFF)) {
-      data |= (1 << i);
-    }
-  }
+  data = frameBuffer[addr];
   if (debug) {
     printf(", data = 0x%08X ****\n", data);
   }
@@ -443,34 +1297,48 @@ Word graphRead(Word addr) {
 
 void graphWrite(Word addr, Word data) {
   int x, y;
-  int i;
 
   if (debug) {
     printf("\n**** GRAPH WRITE to 0x%08X, data = 0x%08X ****\n",
            addr, data);
   }
-  if (!installed) {
+  if (addr >= WINDOW_SIZE_X * WINDOW_SIZE_Y / 32) {
     return;
   }
-  if (addr >= WINDOW_SIZE_X * WINDOW_SIZE_Y / 32) {
+  if (frameBuffer[addr] == data) {
+    /* nothing changes on the screen */
     return;
   }
-  /* write pixels to frame buffer memory */
+  frameBuffer[addr] = data;
+  if (!installed) {
+    return;
+  }
+  /* write pixels to the image */
   addr <<= 5;
   x = addr % WINDOW_SIZE_X;
   y = WINDOW_SIZE_Y - 1 - addr / WINDOW_SIZE_X;
-  for (i = 0; i < 32; i++) {
-    if ((data & (1 << i)) == 0) {
-      vgaWrite(x + i, y,
-               (BACKGROUND >> 16) & 0xFF,
-               (BACKGROUND >>  8) & 0xFF,
-               (BACKGROUND >>  0) & 0xFF);
-    } else {
-      vgaWrite(x + i, y,
-               (FOREGROUND >> 16) & 0xFF,
-               (FOREGROUND >>  8) & 0xFF,
-               (FOREGROUND >>  0) & 0xFF);
-    }
+  if (rfbPort == 0) {
+    vgaWrite(x, y, data);
+  }
+  /* the pixels are in place, now mark the tile dirty */
+  __atomic_fetch_or(&dirtyTiles[y / DIRTY_TILE_Y],
+                    (Word) 1 << (x / DIRTY_TILE_X), __ATOMIC_RELEASE);
+}
+
+
+static void showDropped(void);
+
+
+/*
+ * serve the display by RFB on the given port
+ * instead of opening a window on the X server
+ */
+void graphSetRFB(char *port) {
+  char *endp;
+
+  rfbPort = strtol(port, &endp, 0);
+  if (*endp != '\0' || rfbPort <= 0 || rfbPort > 65535) {
+    error("illegal RFB port '%s'", port);
   }
 }
 
@@ -485,6 +1353,7 @@ void graphExit(void) {
     return;
   }
   vgaExit();
+  showDropped();
 }
 
 
@@ -664,97 +1533,207 @@ static Keycode *lookupKeycode(unsigned int xKeycode) {
 
 /**************************************************************/
 
-/* keyboard buffer */
+/* input queues */
 
 
-#define KEYBD_BUF_SIZE		(1 << 4)
+/*
+ * Input travels from the monitor thread to the CPU thread
+ * through two single-producer single-consumer rings: only the
+ * monitor thread advances a head, only the CPU thread advances
+ * a tail. The keyboard ring holds scancodes. The mouse ring
+ * holds the mouse state at each button change, so that a
+ * short click is never lost between two reads; mere moves are
+ * coalesced into mouseNow. Input which does not fit is dropped
+ * and counted. Sizes must be powers of 2.
+ */
+
+#define KEYBD_BUF_SIZE		(1 << 8)
 #define KEYBD_BUF_MASK		(KEYBD_BUF_SIZE - 1)
 
+#define MOUSE_BUF_SIZE		(1 << 4)
+#define MOUSE_BUF_MASK		(MOUSE_BUF_SIZE - 1)
+
+/* reads which see a queued mouse state before the next one */
+#define MOUSE_HOLD		4
 
-static int rKeybd = 0;		/* keyboard ready? */
 
 static Byte keybdBuf[KEYBD_BUF_SIZE];
-static int keybdBufWrIndex = 0;
-static int keybdBufRdIndex = 0;
+static unsigned int keybdHead = 0;
+static unsigned int keybdTail = 0;
+static unsigned long keybdDropped = 0;
+
+static Word mouseBuf[MOUSE_BUF_SIZE];
+static unsigned int mouseHead = 0;
+static unsigned int mouseTail = 0;
+static unsigned long mouseDropped = 0;
 
+static Word mouseNow = 0;	/* current state, set by monitor thread */
+static Word mouseHeld;		/* queued state, being read by CPU */
+static int mouseHoldCount = 0;
 
-static void putKeycode(Byte code) {
-  int newWrIndex;
 
-  newWrIndex = (keybdBufWrIndex + 1) & KEYBD_BUF_MASK;
-  if (newWrIndex != keybdBufRdIndex) {
-    keybdBuf[keybdBufWrIndex] = code;
-    keybdBufWrIndex = newWrIndex;
-    rKeybd = 1;
+/*
+ * put the scancodes of one key event into the keyboard
+ * ring, either all of them or (if full) none of them
+ */
+static void putKeycodes(Byte *codes, int n) {
+  unsigned int head;
+  int i;
+
+  head = keybdHead;
+  if (head - __atomic_load_n(&keybdTail, __ATOMIC_ACQUIRE) + n >
+      KEYBD_BUF_SIZE) {
+    keybdDropped += n;
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    keybdBuf[(head + i) & KEYBD_BUF_MASK] = codes[i];
+  }
+  __atomic_store_n(&keybdHead, head + n, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * report what did not fit into the queues,
+ * once the monitor thread has terminated
+ */
+static void showDropped(void) {
+  if (keybdDropped != 0 || mouseDropped != 0) {
+    printf("input dropped: %lu keyboard codes, %lu mouse events\n",
+           keybdDropped, mouseDropped);
   }
 }
 
 
+static Bool keybdReady(void) {
+  return __atomic_load_n(&keybdHead, __ATOMIC_ACQUIRE) != keybdTail;
+}
+
+
 static Byte getKeycode(void) {
+  unsigned int tail;
   Byte code;
 
-  if (keybdBufRdIndex != keybdBufWrIndex) {
-    code = keybdBuf[keybdBufRdIndex];
-    keybdBufRdIndex = (keybdBufRdIndex + 1) & KEYBD_BUF_MASK;
-    if (keybdBufRdIndex == keybdBufWrIndex) {
-      rKeybd = 0;
-    }
-  } else {
-    code = 0;
+  tail = keybdTail;
+  if (__atomic_load_n(&keybdHead, __ATOMIC_ACQUIRE) == tail) {
+    return 0;
   }
+  code = keybdBuf[tail & KEYBD_BUF_MASK];
+  __atomic_store_n(&keybdTail, tail + 1, __ATOMIC_RELEASE);
   return code;
 }
 
 
+static void putMouse(Word state, Bool buttons) {
+  unsigned int head;
+
+  __atomic_store_n(&mouseNow, state, __ATOMIC_RELEASE);
+  if (!buttons) {
+    return;
+  }
+  head = mouseHead;
+  if (head - __atomic_load_n(&mouseTail, __ATOMIC_ACQUIRE) ==
+      MOUSE_BUF_SIZE) {
+    mouseDropped++;
+    return;
+  }
+  mouseBuf[head & MOUSE_BUF_MASK] = state;
+  __atomic_store_n(&mouseHead, head + 1, __ATOMIC_RELEASE);
+}
+
+
+static Word getMouse(void) {
+  unsigned int tail;
+
+  if (mouseHoldCount == 0) {
+    tail = mouseTail;
+    if (__atomic_load_n(&mouseHead, __ATOMIC_ACQUIRE) != tail) {
+      mouseHeld = mouseBuf[tail & MOUSE_BUF_MASK];
+      __atomic_store_n(&mouseTail, tail + 1, __ATOMIC_RELEASE);
+      mouseHoldCount = MOUSE_HOLD;
+    }
+  }
+  if (mouseHoldCount > 0) {
+    mouseHoldCount--;
+    return mouseHeld;
+  }
+  return __atomic_load_n(&mouseNow, __ATOMIC_ACQUIRE);
+}
+
+
+/**************************************************************/
+
+/* input notification, for a CPU waiting in an idle loop */
+
+
+static pthread_mutex_t inputLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inputCond = PTHREAD_COND_INITIALIZER;
+static Bool inputArrived = false;
+
+
+static void signalInput(void) {
+  pthread_mutex_lock(&inputLock);
+  inputArrived = true;
+  pthread_cond_signal(&inputCond);
+  pthread_mutex_unlock(&inputLock);
+}
+
+
 /**************************************************************/
 
 /* event handlers */
 
 
+/* these are only touched by the monitor thread */
 static int xMouse = 0;		/* mouse x position */
 static int yMouse = 0;		/* mouse y position */
 static int bMouse = 0;		/* mouse button status */
 
 
+#define MOUSE_STATE()		(bMouse << 24 | yMouse << 12 | xMouse)
+
+
 static void doMouseMove(int x, int y) {
   xMouse = x;
   yMouse = WINDOW_SIZE_Y - 1 - y;
+  putMouse(MOUSE_STATE(), false);
+  signalInput();
 }
 
 
 static void doButtonPress(int b) {
   bMouse |= (1 << (3 - b));
+  putMouse(MOUSE_STATE(), true);
+  signalInput();
 }
 
 
 static void doButtonRelease(int b) {
   bMouse &= ~(1 << (3 - b));
+  putMouse(MOUSE_STATE(), true);
+  signalInput();
 }
 
 
 static void doKeyPress(int k) {
   Keycode *keycode;
-  int i;
 
   keycode = lookupKeycode(k);
   if (keycode != NULL) {
-    for (i = 0; i < keycode->pcNumMake; i++) {
-      putKeycode(keycode->pcKeyMake[i]);
-    }
+    putKeycodes(keycode->pcKeyMake, keycode->pcNumMake);
   }
+  signalInput();
 }
 
 
 static void doKeyRelease(int k) {
   Keycode *keycode;
-  int i;
 
   keycode = lookupKeycode(k);
   if (keycode != NULL) {
-    for (i = 0; i < keycode->pcNumBreak; i++) {
-      putKeycode(keycode->pcKeyBreak[i]);
-    }
+    putKeycodes(keycode->pcKeyBreak, keycode->pcNumBreak);
   }
+  signalInput();
 }
 
 
@@ -764,7 +1743,7 @@ static void doKeyRelease(int k) {
 
 
 Word mouseRead(void) {
-  return rKeybd << 28 | bMouse << 24 | yMouse << 12 | xMouse;
+  return (keybdReady() ? 1 << 28 : 0) | getMouse();
 }
 
 
@@ -773,6 +1752,31 @@ Word keybdRead(void) {
 }
 
 
+/*
+ * wait until a mouse or keyboard event arrives,
+ * but not longer than the given number of usec
+ */
+void mouseKeybdWait(int usec) {
+  struct timespec until;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += usec / 1000000;
+  until.tv_nsec += (long) (usec % 1000000) * 1000;
+  if (until.tv_nsec >= 1000 * 1000 * 1000) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000 * 1000 * 1000;
+  }
+  pthread_mutex_lock(&inputLock);
+  while (!inputArrived) {
+    if (pthread_cond_timedwait(&inputCond, &inputLock, &until) != 0) {
+      break;
+    }
+  }
+  inputArrived = false;
+  pthread_mutex_unlock(&inputLock);
+}
+
+
 void mouseKeybdInit(void) {
   initKeycode();
 }
@@ -10,11 +10,13 @@
 Word graphRead(Word addr);
 void graphWrite(Word addr, Word data);
 
+void graphSetRFB(char *port);
 void graphInit(void);
 void graphExit(void);
 
 Word mouseRead(void);
 Word keybdRead(void);
+void mouseKeybdWait(int usec);
 
 void mouseKeybdInit(void);
 
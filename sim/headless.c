@@ -0,0 +1,109 @@
+/*
+ * headless.c -- graphics controller simulation without a display
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "graph.h"
+
+
+static Bool debug = false;
+
+
+/**************************************************************/
+
+/* graphics device interface */
+
+
+#define WINDOW_SIZE_X		1024
+#define WINDOW_SIZE_Y		768
+
+
+/*
+ * the frame buffer in the same packed 1 bpp layout
+ * as seen by the CPU: bit i of word n is pixel 32*n+i,
+ * lines counted from the bottom, set bits are black;
+ * there is one for each thread, as there is a machine
+ */
+static __thread Word frameBuffer[WINDOW_SIZE_X * WINDOW_SIZE_Y / 32];
+
+
+Word graphRead(Word addr) {
+  Word data;
+
+  if (debug) {
+    printf("\n**** GRAPH READ from 0x%08X", addr);
+  }
+  if (addr >= WINDOW_SIZE_X * WINDOW_SIZE_Y / 32) {
+    return 0;
+  }
+  data = frameBuffer[addr];
+  if (debug) {
+    printf(", data = 0x%08X ****\n", data);
+  }
+  return data;
+}
+
+
+void graphWrite(Word addr, Word data) {
+  if (debug) {
+    printf("\n**** GRAPH WRITE to 0x%08X, data = 0x%08X ****\n",
+           addr, data);
+  }
+  if (addr >= WINDOW_SIZE_X * WINDOW_SIZE_Y / 32) {
+    return;
+  }
+  frameBuffer[addr] = data;
+}
+
+
+void graphSetRFB(char *port) {
+  error("no display to serve in the headless simulator");
+}
+
+
+void graphInit(void) {
+  memset(frameBuffer, 0, sizeof(frameBuffer));
+}
+
+
+void graphExit(void) {
+}
+
+
+/**************************************************************/
+
+/* mouse and keyboard device interface */
+
+
+Word mouseRead(void) {
+  /* no keyboard data ready, no buttons pressed */
+  return 0;
+}
+
+
+Word keybdRead(void) {
+  return 0;
+}
+
+
+/*
+ * no input will ever arrive,
+ * so just sleep for the given number of usec
+ */
+void mouseKeybdWait(int usec) {
+  struct timespec delay;
+
+  delay.tv_sec = usec / 1000000;
+  delay.tv_nsec = (long) (usec % 1000000) * 1000;
+  nanosleep(&delay, NULL);
+}
+
+
+void mouseKeybdInit(void) {
+}
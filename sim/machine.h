@@ -0,0 +1,57 @@
+/*
+ * machine.h -- RISC5 machines hosted by another program
+ */
+
+
+#ifndef _MACHINE_H_
+#define _MACHINE_H_
+
+
+/*
+ * A machine lives in the thread which created it: all other
+ * functions must be called from that thread, except for
+ * machineHalt(), which may be called from anywhere. There is
+ * no machine context passed around inside the simulator; its
+ * state is kept in thread-local variables instead. Hence:
+ *
+ *   - Each thread can host one machine at a time. A second
+ *     machineCreate() in the same thread ends the program.
+ *   - A machine cannot move to another thread, so it cannot
+ *     be served by a pool of worker threads. Using it from a
+ *     thread other than its creator ends the program.
+ *   - Only the headless library built by 'make lib' can host
+ *     more than one machine. The display of the X11 build
+ *     (graph.c) and its keyboard and mouse input are global
+ *     and belong to a single machine.
+ *   - Command line options and debug switches of the
+ *     simulator are shared by all machines.
+ *
+ * Inside sim.c, every static variable which holds machine
+ * state, including function-local ones, must be declared
+ * PER_MACHINE; one that is not is silently shared by all
+ * machines.
+ *
+ * machineHalt() clears the machine's run flag atomically; the
+ * owner polls the flag (also atomically) between instructions,
+ * so machineRun() returns shortly afterwards. A halt which
+ * arrives before machineRun() has started is forgotten.
+ *
+ * A fault of the simulated machine (e.g., an unaligned access,
+ * an undefined instruction, an unknown I/O device) prints its
+ * message and ends only that machine: machineRun() returns -2,
+ * and so does every later call; machineStep() does nothing any
+ * more. The machine must still be destroyed. Errors within
+ * machineCreate() and machineDestroy() end the program.
+ */
+
+typedef struct machine Machine;
+
+Machine *machineCreate(char *promName, char *ramName,
+                       char *diskName, Word initialSwitches);
+void machineStep(Machine *m);
+int machineRun(Machine *m);
+void machineHalt(Machine *m);
+void machineDestroy(Machine *m);
+
+
+#endif /* _MACHINE_H_ */
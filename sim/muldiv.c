@@ -11,8 +11,16 @@
 #include "muldiv.h"
 
 
+static Bool bitSerial = false;	/* use the hardware algorithms */
+static Bool checkFast = false;	/* compare fast and bit-serial results */
+
+
 /**************************************************************/
 
+/*
+ * bit-serial algorithms, as implemented in hardware
+ */
+
 
 static Word addWord(Word x, Word y, Bool *carry) {
   Word res;
@@ -23,7 +31,8 @@ static Word addWord(Word x, Word y, Bool *carry) {
 }
 
 
-void intMul(Word x, Word y, Bool u, Word *loResPtr, Word *hiResPtr) {
+static void serialMul(Word x, Word y, Bool u,
+                      Word *loResPtr, Word *hiResPtr) {
   Bool x_neg;
   Bool y_neg;
   Word y_abs;
@@ -70,9 +79,6 @@ void intMul(Word x, Word y, Bool u, Word *loResPtr, Word *hiResPtr) {
 }
 
 
-/**************************************************************/
-
-
 static Word subWord(Word x, Word y, Bool *borrow) {
   Word res;
 
@@ -82,7 +88,8 @@ static Word subWord(Word x, Word y, Bool *borrow) {
 }
 
 
-void intDiv(Word x, Word y, Bool u, Word *quoPtr, Word *remPtr) {
+static void serialDiv(Word x, Word y, Bool u,
+                      Word *quoPtr, Word *remPtr) {
   Bool x_neg;
   Bool y_neg;
   Word y_abs;
@@ -126,3 +133,180 @@ void intDiv(Word x, Word y, Bool u, Word *quoPtr, Word *remPtr) {
   *quoPtr = (x_neg == y_neg) ? quot : -quot;
   *remPtr = corr ? y_abs - upper : upper;
 }
+
+
+/**************************************************************/
+
+/*
+ * fast versions, using the host's 64-bit arithmetic
+ */
+
+
+static void fastMul(Word x, Word y, Bool u,
+                    Word *loResPtr, Word *hiResPtr) {
+  unsigned long long prod;
+
+  if (u) {
+    prod = (unsigned long long) x * y;
+  } else {
+    /* the bit-serial result is the full signed product */
+    prod = (long long) (int) x * (int) y;
+  }
+  *loResPtr = prod;
+  *hiResPtr = prod >> 32;
+}
+
+
+static void fastDiv(Word x, Word y, Bool u,
+                    Word *quoPtr, Word *remPtr) {
+  Bool x_neg;
+  Bool y_neg;
+  Word x_abs;
+  Word y_abs;
+  Word quot;
+  Word rem;
+  Bool corr;
+
+  x_neg = !u && ((x & 0x80000000) != 0);
+  y_neg = !u && ((y & 0x80000000) != 0);
+  x_abs = x_neg ? -x : x;
+  y_abs = y_neg ? -y : y;
+  if (y_abs == 0) {
+    /* every trial subtraction succeeds */
+    quot = 0xFFFFFFFF;
+    rem = x_abs;
+  } else {
+    quot = x_abs / y_abs;
+    rem = x_abs % y_abs;
+  }
+  /* a negative dividend gets a non-negative remainder */
+  corr = x_neg && (rem != 0);
+  if (corr) {
+    quot++;
+    rem = y_abs - rem;
+  }
+  *quoPtr = (x_neg == y_neg) ? quot : -quot;
+  *remPtr = rem;
+}
+
+
+/**************************************************************/
+
+
+static void checkMul(Word x, Word y, Bool u) {
+  Word lo1, hi1;
+  Word lo2, hi2;
+
+  fastMul(x, y, u, &lo1, &hi1);
+  serialMul(x, y, u, &lo2, &hi2);
+  if (lo1 != lo2 || hi1 != hi2) {
+    error("MUL%s 0x%08X, 0x%08X: fast 0x%08X:%08X, "
+          "bit-serial 0x%08X:%08X",
+          u ? "U" : "", x, y, hi1, lo1, hi2, lo2);
+  }
+}
+
+
+static void checkDiv(Word x, Word y, Bool u) {
+  Word quo1, rem1;
+  Word quo2, rem2;
+
+  fastDiv(x, y, u, &quo1, &rem1);
+  serialDiv(x, y, u, &quo2, &rem2);
+  if (quo1 != quo2 || rem1 != rem2) {
+    error("DIV%s 0x%08X, 0x%08X: fast 0x%08X rem 0x%08X, "
+          "bit-serial 0x%08X rem 0x%08X",
+          u ? "U" : "", x, y, quo1, rem1, quo2, rem2);
+  }
+}
+
+
+static void checkBoth(Word x, Word y) {
+  checkMul(x, y, false);
+  checkMul(x, y, true);
+  checkDiv(x, y, false);
+  checkDiv(x, y, true);
+}
+
+
+/*
+ * compare the fast versions with the bit-serial ones:
+ * all pairs of values near powers of two (and their
+ * negations), all pairs of small values, and a stream
+ * of pseudo-random pairs
+ */
+static void checkAll(void) {
+  Word edge[6 * 33];
+  int numEdge;
+  int i, j;
+  Word x, y;
+
+  numEdge = 0;
+  for (i = 0; i <= 32; i++) {
+    x = (i == 32) ? 0 : (Word) 1 << i;
+    edge[numEdge++] = x - 1;
+    edge[numEdge++] = x;
+    edge[numEdge++] = x + 1;
+    edge[numEdge++] = -(x - 1);
+    edge[numEdge++] = -x;
+    edge[numEdge++] = -(x + 1);
+  }
+  for (i = 0; i < numEdge; i++) {
+    for (j = 0; j < numEdge; j++) {
+      checkBoth(edge[i], edge[j]);
+    }
+  }
+  for (i = -256; i < 256; i++) {
+    for (j = -256; j < 256; j++) {
+      checkBoth(i, j);
+    }
+  }
+  x = 1;
+  for (i = 0; i < 1000000; i++) {
+    x = x * 1664525 + 1013904223;
+    y = x >> (i & 31);
+    x = x * 1664525 + 1013904223;
+    checkBoth(x, (i & 32) ? y : -y);
+  }
+}
+
+
+/**************************************************************/
+
+
+void intMul(Word x, Word y, Bool u, Word *loResPtr, Word *hiResPtr) {
+  if (bitSerial) {
+    serialMul(x, y, u, loResPtr, hiResPtr);
+    return;
+  }
+  if (checkFast) {
+    checkMul(x, y, u);
+  }
+  fastMul(x, y, u, loResPtr, hiResPtr);
+}
+
+
+void intDiv(Word x, Word y, Bool u, Word *quoPtr, Word *remPtr) {
+  if (bitSerial) {
+    serialDiv(x, y, u, quoPtr, remPtr);
+    return;
+  }
+  if (checkFast) {
+    checkDiv(x, y, u);
+  }
+  fastDiv(x, y, u, quoPtr, remPtr);
+}
+
+
+/*
+ * serial: use the bit-serial algorithms
+ * check: compare fast and bit-serial results, now for a large
+ *        sample of operands, later for every operation
+ */
+void intInit(Bool serial, Bool check) {
+  bitSerial = serial;
+  checkFast = check;
+  if (checkFast) {
+    checkAll();
+  }
+}
@@ -10,5 +10,7 @@
 void intMul(Word x, Word y, Bool u, Word *loResPtr, Word *hiResPtr);
 void intDiv(Word x, Word y, Bool u, Word *quoPtr, Word *remPtr);
 
+void intInit(Bool serial, Bool check);
+
 
 #endif /* _MULDIV_H_ */
@@ -13,11 +13,21 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "common.h"
 #include "muldiv.h"
 #include "fpu.h"
 #include "graph.h"
+#include "machine.h"
 
 #include "getline.h"
 
@@ -31,11 +41,10 @@
 #define CC_PER_INST	4.0			/* clock cycles per inst */
 #define INST_PER_MSEC	((int)((1000.0 * CC_PER_USEC) / CC_PER_INST + 0.5))
 #define BAUD_RATE	38400			/* serial line speed */
-#define MSEC_PER_CHAR	(10 * (1000.0 / BAUD_RATE))
-#define INST_PER_CHAR	((int)(INST_PER_MSEC * MSEC_PER_CHAR + 0.5))
 
 #define IRQ_HPT_0	15			/* high prec timer 0 IRQ */
 #define IRQ_HPT_1	14			/* high prec timer 1 IRQ */
+#define IRQ_PVD		13			/* paravirt. block device IRQ */
 #define IRQ_TIMER	11			/* millisec timer IRQ */
 #define IRQ_RS232_0_RCV	7			/* RS232 0 receive IRQ */
 #define IRQ_RS232_0_XMT	6			/* RS232 0 transmit IRQ */
@@ -63,6 +72,27 @@
 #define MAX_TOKENS	20
 
 
+/**************************************************************/
+
+/*
+ * machine state
+ *     Every variable which is part of the simulated machine is
+ *     thread-local, so each thread of the host can run a machine
+ *     of its own (see "machine interface"). The options set on
+ *     the command line are shared by all machines. This holds
+ *     for static variables within functions, too: they must be
+ *     declared PER_MACHINE as well.
+ */
+
+
+#define PER_MACHINE	__thread
+
+
+static PER_MACHINE Machine *hosted = NULL;	/* NULL if run by main() */
+
+static void hostedShutdown(int exitCode);
+
+
 /**************************************************************/
 
 /* interrupt interface to CPU */
@@ -72,6 +102,241 @@ void cpuSetInterrupt(int priority);
 void cpuResetInterrupt(int priority);
 
 
+/**************************************************************/
+
+/* idle detection interface to CPU */
+
+
+static PER_MACHINE Bool idleQuiet = false;	/* cleared by every side effect */
+
+void cpuIdleRead(int dev, Word data);
+
+
+/**************************************************************/
+
+/*
+ * device event scheduler
+ *
+ * Simulated time is counted in instructions. The devices
+ * schedule events for the instruction at which they next
+ * have to act, and the CPU only calls runEvents() when the
+ * earliest event is due. Events due at the same instruction
+ * never touch the same device state, so their order does
+ * not matter.
+ */
+
+
+#define MAX_EVENTS	16
+
+typedef unsigned long long Time;
+
+typedef struct event {
+  char *name;				/* for diagnostic messages */
+  void (*handler)(struct event *ev);	/* called when event is due */
+  Time due;				/* instruction to act upon */
+  Time fired;				/* when the event fired last */
+  int slot;				/* heap index, -1 if idle */
+} Event;
+
+
+static PER_MACHINE Time simTime = 0;			/* instructions started so far */
+static PER_MACHINE Time nextEvent = ~(Time) 0;		/* when earliest event is due */
+static PER_MACHINE Event *eventHeap[MAX_EVENTS];	/* min-heap, ordered by due */
+static PER_MACHINE int numEvents = 0;
+static Bool checkEvents = false;	/* check device event timing */
+static Bool tickAlways = false;		/* call tickDevices() every inst */
+
+
+static void eventUpdate(void) {
+  if (tickAlways) {
+    nextEvent = simTime + 1;
+  } else {
+    nextEvent = numEvents > 0 ? eventHeap[0]->due : ~(Time) 0;
+  }
+}
+
+
+static void eventPlace(Event *ev, int i) {
+  eventHeap[i] = ev;
+  ev->slot = i;
+}
+
+
+static void eventSift(int i) {
+  Event *ev;
+  int j;
+
+  ev = eventHeap[i];
+  while (i > 0 && eventHeap[(i - 1) / 2]->due > ev->due) {
+    eventPlace(eventHeap[(i - 1) / 2], i);
+    i = (i - 1) / 2;
+  }
+  while ((j = 2 * i + 1) < numEvents) {
+    if (j + 1 < numEvents && eventHeap[j + 1]->due < eventHeap[j]->due) {
+      j++;
+    }
+    if (eventHeap[j]->due >= ev->due) {
+      break;
+    }
+    eventPlace(eventHeap[j], i);
+    i = j;
+  }
+  eventPlace(ev, i);
+}
+
+
+static void eventCancel(Event *ev) {
+  int i;
+
+  i = ev->slot;
+  if (i < 0) {
+    return;
+  }
+  ev->slot = -1;
+  if (i != --numEvents) {
+    eventPlace(eventHeap[numEvents], i);
+    eventSift(i);
+  }
+  eventUpdate();
+}
+
+
+/*
+ * schedule an event for instruction 'due' (which must lie
+ * in the future), replacing any pending one for this event
+ */
+static void eventSchedule(Event *ev, Time due) {
+  ev->due = due;
+  if (ev->slot < 0) {
+    if (numEvents == MAX_EVENTS) {
+      error("too many device events");
+    }
+    eventPlace(ev, numEvents++);
+  }
+  eventSift(ev->slot);
+  eventUpdate();
+}
+
+
+static void runEvents(void) {
+  Event *ev;
+
+  while (numEvents > 0 && eventHeap[0]->due <= simTime) {
+    ev = eventHeap[0];
+    eventCancel(ev);
+    ev->fired = simTime;
+    (*ev->handler)(ev);
+    idleQuiet = false;
+  }
+}
+
+
+/**************************************************************/
+
+/*
+ * host time
+ *     The host clock only runs while the CPU runs continuously,
+ *     so that pauses in the monitor do not count. By default,
+ *     simulated time is just the number of instructions, and
+ *     the CPU runs as fast as the host allows. In paced mode,
+ *     the CPU is throttled so that simulated time keeps up
+ *     with host time, but does not run ahead of it. In turbo
+ *     mode, the CPU is not throttled, but the millisecond timer
+ *     follows host time instead of the number of instructions.
+ */
+
+
+#define PACE_INTERVAL	INST_PER_MSEC	/* check the pace every msec */
+#define PACE_MAX_LAG	50000		/* give up catching up, usec */
+
+
+static Bool paced = false;		/* throttle to host time */
+static Bool turbo = false;		/* timer counts host time */
+
+static PER_MACHINE long long hostRunStart;	/* host usec when run began */
+static PER_MACHINE long long hostRunTotal = 0;	/* usec of all previous runs */
+static PER_MACHINE Bool hostRunning = false;
+static PER_MACHINE long long paceLag = 0;	/* usec given up by pacing */
+static PER_MACHINE Time skippedTime = 0;	/* insts skipped while idle */
+
+
+static long long hostMicroSeconds(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+static long long hostElapsed(void) {
+  if (!hostRunning) {
+    return hostRunTotal;
+  }
+  return hostRunTotal + (hostMicroSeconds() - hostRunStart);
+}
+
+
+static void hostStartRun(void) {
+  hostRunStart = hostMicroSeconds();
+  hostRunning = true;
+}
+
+
+static void hostStopRun(void) {
+  hostRunTotal = hostElapsed();
+  hostRunning = false;
+}
+
+
+static void pace(Event *ev) {
+  long long ahead;
+
+  eventSchedule(ev, simTime + PACE_INTERVAL);
+  if (!hostRunning) {
+    /* single steps are not paced */
+    return;
+  }
+  ahead = (long long) simTime * 1000 / INST_PER_MSEC -
+          (hostElapsed() - paceLag);
+  if (ahead > 0) {
+    /* input arriving ends the wait early, no harm done */
+    mouseKeybdWait(ahead);
+  } else
+  if (ahead < -PACE_MAX_LAG) {
+    /* the host is too slow: do not try to catch up later */
+    paceLag -= ahead;
+  }
+}
+
+
+static PER_MACHINE Event paceEvent = { "pace", pace, 0, 0, -1 };
+
+
+void initHostTime(void) {
+  if (paced) {
+    eventSchedule(&paceEvent, simTime + PACE_INTERVAL);
+  }
+}
+
+
+void showHostTime(void) {
+  double simSec, hostSec;
+  Time executed;
+
+  simSec = (double) simTime / (INST_PER_MSEC * 1000.0);
+  hostSec = (double) hostElapsed() / 1000000.0;
+  executed = simTime - skippedTime;
+  printf("%llu instructions executed, %llu skipped while idle\n",
+         executed, skippedTime);
+  printf("%.3f sec simulated, %.3f sec real, slip %+.3f sec",
+         simSec, hostSec, hostSec - simSec);
+  if (hostSec > 0.0) {
+    printf(", %.2f MIPS", executed / hostSec / 1000000.0);
+  }
+  printf("\n");
+}
+
+
 /**************************************************************/
 
 /*
@@ -81,26 +346,38 @@ void cpuResetInterrupt(int priority);
 
 #define TIMER_IEN		0x01
 
+#define TURBO_POLL	(INST_PER_MSEC / 10)	/* host time poll, turbo */
 
-static Word milliSeconds;
-static Word timerControl;
-static Bool timerExpired;
 
+static PER_MACHINE Word milliSeconds;
+static PER_MACHINE Word timerControl;
+static PER_MACHINE Bool timerExpired;
 
-void tickTimer(void) {
-  static int count = 0;
 
-  if (++count == INST_PER_MSEC) {
-    count = 0;
-    milliSeconds++;
-    timerExpired = true;
-    if (timerControl & TIMER_IEN) {
-      cpuSetInterrupt(IRQ_TIMER);
+static void expireTimer(Event *ev) {
+  Word msec;
+
+  if (turbo) {
+    eventSchedule(ev, simTime + TURBO_POLL);
+    msec = hostElapsed() / 1000;
+    if (msec == milliSeconds) {
+      return;
     }
+    milliSeconds = msec;
+  } else {
+    eventSchedule(ev, simTime + INST_PER_MSEC);
+    milliSeconds++;
+  }
+  timerExpired = true;
+  if (timerControl & TIMER_IEN) {
+    cpuSetInterrupt(IRQ_TIMER);
   }
 }
 
 
+static PER_MACHINE Event timerEvent = { "timer", expireTimer, 0, 0, -1 };
+
+
 /*
  * read device 0:
  *     reset device interrupt
@@ -138,6 +415,8 @@ void initTimer(void) {
   milliSeconds = 0;
   timerControl = 0;
   timerExpired = false;
+  eventSchedule(&timerEvent,
+                simTime + (turbo ? TURBO_POLL : INST_PER_MSEC));
 }
 
 
@@ -148,7 +427,7 @@ void initTimer(void) {
  */
 
 
-static Word currentSwitches;
+static PER_MACHINE Word currentSwitches;
 
 
 void setSwitches(Word data) {
@@ -168,7 +447,7 @@ Word readSwitches(void) {
 }
 
 
-static Word currentLEDs = -1;
+static PER_MACHINE Word currentLEDs = -1;
 
 
 void showLEDs(void) {
@@ -206,188 +485,554 @@ void initSWLED(Word initialSwitches) {
 /**************************************************************/
 
 /*
- * I/O devices 2, 3: RS232 0
+ * host side of the serial lines
+ *     Each line has a host thread which moves the bytes between
+ *     the pseudo terminal and two single-producer single-consumer
+ *     rings, one for each direction. The simulated UART only
+ *     touches the rings. The thread sleeps in poll() and is woken
+ *     through a pipe when there are bytes to send, or space to
+ *     receive into. Bytes to send are handed over in bursts of
+ *     SERIAL_BURST bytes, or when the transmitter becomes empty.
  */
 
 
-#define SERIAL_RCV_RDY		0x01
-#define SERIAL_XMT_RDY		0x02
-#define SERIAL_XMT_EMPTY	0x04
+#define SERIAL_RING_SIZE	16384		/* must be a power of 2 */
+#define SERIAL_RING_MASK	(SERIAL_RING_SIZE - 1)
+#define SERIAL_BURST		64		/* hand over at the latest */
+#define SERIAL_HUP_WAIT		20		/* msec, no one on the line */
 
-#define SERIAL_RCV_RDY_IEN	0x01
-#define SERIAL_XMT_RDY_IEN	0x02
-#define SERIAL_XMT_EMPTY_IEN	0x04
 
+typedef struct {
+  unsigned head;			/* advanced by the producer */
+  unsigned tail;			/* advanced by the consumer */
+  Byte data[SERIAL_RING_SIZE];
+} SerialRing;
 
-static FILE *serialIn_0;
-static FILE *serialOut_0;
-static Word serialRcvData_0;
-static Word serialXmtData_0;
-static Word serialStatus_0;
-static Word serialControl_0;
 
+typedef struct {
+  int fd;				/* pseudo terminal master */
+  int wake[2];				/* pipe to wake the thread */
+  pthread_t thread;
+  Bool running;				/* thread started */
+  Bool stop;				/* thread shall exit */
+  Bool waiting;				/* thread may sleep in poll() */
+  SerialRing rcv;			/* filled by the thread */
+  SerialRing xmt;			/* emptied by the thread */
+} SerialHost;
 
-void tickRS232_0(void) {
-  static int rcvCount = 0;
-  static int xmtCount = 0;
-  static int emptyCount = 0;
-  int c;
 
-  if (rcvCount++ == INST_PER_CHAR) {
-    rcvCount = 0;
-    c = fgetc(serialIn_0);
-    if (c != EOF) {
-      serialRcvData_0 = c & 0xFF;
-      serialStatus_0 |= SERIAL_RCV_RDY;
-      if (serialControl_0 & SERIAL_RCV_RDY_IEN) {
-        cpuSetInterrupt(IRQ_RS232_0_RCV);
-      }
-    }
-  }
-  if ((serialStatus_0 & SERIAL_XMT_RDY) == 0) {
-    if (xmtCount++ == INST_PER_CHAR) {
-      xmtCount = 0;
-      emptyCount = 0;
-      fputc(serialXmtData_0 & 0xFF, serialOut_0);
-      serialStatus_0 |= SERIAL_XMT_RDY;
-      if (serialControl_0 & SERIAL_XMT_RDY_IEN) {
-        cpuSetInterrupt(IRQ_RS232_0_XMT);
-      }
-    }
-  } else {
-    if ((serialStatus_0 & SERIAL_XMT_EMPTY) == 0) {
-      // one character delay until transmitter empty
-      if (emptyCount++ == INST_PER_CHAR) {
-        emptyCount = 0;
-        serialStatus_0 |= SERIAL_XMT_EMPTY;
-        if (serialControl_0 & SERIAL_XMT_EMPTY_IEN) {
-          cpuSetInterrupt(IRQ_RS232_0_XMT);
-        }
-      }
+static unsigned ringUsed(SerialRing *r) {
+  return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) -
+         __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+}
+
+
+static void serialKick(SerialHost *h) {
+  char c;
+
+  if (__atomic_exchange_n(&h->waiting, false, __ATOMIC_SEQ_CST)) {
+    c = 0;
+    if (write(h->wake[1], &c, 1) < 0) {
+      /* the pipe is full, the thread wakes up anyway */
     }
   }
 }
 
 
 /*
- * read device 2:
- *     receiver data
- *     { 24'bx, rcv_data[7:0] }
+ * simulator side: get a received byte, or put a byte
+ * to be sent, return false if the ring is empty or full
  */
-Word readRS232data_0(void) {
-  serialStatus_0 &= ~SERIAL_RCV_RDY;
-  if (serialControl_0 & SERIAL_RCV_RDY_IEN) {
-    cpuResetInterrupt(IRQ_RS232_0_RCV);
+static Bool serialGet(SerialHost *h, Byte *bp) {
+  unsigned tail;
+
+  tail = h->rcv.tail;
+  if (__atomic_load_n(&h->rcv.head, __ATOMIC_ACQUIRE) == tail) {
+    return false;
   }
-  return serialRcvData_0;
+  *bp = h->rcv.data[tail & SERIAL_RING_MASK];
+  __atomic_store_n(&h->rcv.tail, tail + 1, __ATOMIC_SEQ_CST);
+  if (ringUsed(&h->rcv) == SERIAL_RING_SIZE - 1) {
+    /* the thread may have stopped receiving */
+    serialKick(h);
+  }
+  return true;
 }
 
 
-/*
- * write device 2:
- *     transmitter data
- *     { 24'bx, xmt_data[7:0] }
- */
-void writeRS232data_0(Word data) {
-  serialXmtData_0 = data & 0xFF;
-  serialStatus_0 &= ~(SERIAL_XMT_RDY | SERIAL_XMT_EMPTY);
-  if (serialControl_0 & (SERIAL_XMT_RDY_IEN | SERIAL_XMT_EMPTY_IEN)) {
-    cpuResetInterrupt(IRQ_RS232_0_XMT);
+static Bool serialPut(SerialHost *h, Byte b) {
+  unsigned head;
+
+  head = h->xmt.head;
+  if (head - __atomic_load_n(&h->xmt.tail, __ATOMIC_ACQUIRE) ==
+      SERIAL_RING_SIZE) {
+    return false;
+  }
+  h->xmt.data[head & SERIAL_RING_MASK] = b;
+  __atomic_store_n(&h->xmt.head, head + 1, __ATOMIC_SEQ_CST);
+  if (ringUsed(&h->xmt) >= SERIAL_BURST) {
+    serialKick(h);
   }
+  return true;
 }
 
 
 /*
- * read device 3:
- *     status
- *     { 29'bx, xmt_empty, xmt_rdy, rcv_rdy }
+ * thread side: move bytes between the rings and the line;
+ * receiving returns false if no one is connected to the line
  */
-Word readRS232ctrl_0(void) {
-  return serialStatus_0;
+static Bool serialReceive(SerialHost *h) {
+  unsigned head, n;
+  ssize_t res;
+
+  head = h->rcv.head;
+  n = SERIAL_RING_SIZE - ringUsed(&h->rcv);
+  if (n > SERIAL_RING_SIZE - (head & SERIAL_RING_MASK)) {
+    n = SERIAL_RING_SIZE - (head & SERIAL_RING_MASK);
+  }
+  res = read(h->fd, h->rcv.data + (head & SERIAL_RING_MASK), n);
+  if (res <= 0) {
+    return res < 0 && errno == EAGAIN;
+  }
+  __atomic_store_n(&h->rcv.head, head + res, __ATOMIC_SEQ_CST);
+  return true;
 }
 
 
-/*
- * write device 3:
- *     control
- *     { set_baud, baud[2:0], 25'bx,
- *       xmt_empty_ien, xmt_rdy_ien, rcv_rdy_ien }
- *     baud    baud rate
- *     000     2400
- *     001     4800
- *     010     9600    (default)
- *     011     19200
- *     100     31250   (for MIDI)
- *     101     38400
- *     110     57600
- *     111     115200
- */
-void writeRS232ctrl_0(Word data) {
-  /* handle interrupt control */
-  if (data & SERIAL_RCV_RDY_IEN) {
-    serialControl_0 |= SERIAL_RCV_RDY_IEN;
-  } else {
-    serialControl_0 &= ~SERIAL_RCV_RDY_IEN;
+static void serialTransmit(SerialHost *h) {
+  unsigned tail, n;
+  ssize_t res;
+
+  tail = h->xmt.tail;
+  n = ringUsed(&h->xmt);
+  if (n > SERIAL_RING_SIZE - (tail & SERIAL_RING_MASK)) {
+    n = SERIAL_RING_SIZE - (tail & SERIAL_RING_MASK);
   }
-  if ((serialControl_0 & SERIAL_RCV_RDY_IEN) &&
-      (serialStatus_0 & SERIAL_RCV_RDY)) {
-    cpuSetInterrupt(IRQ_RS232_0_RCV);
-  } else {
-    cpuResetInterrupt(IRQ_RS232_0_RCV);
+  res = write(h->fd, h->xmt.data + (tail & SERIAL_RING_MASK), n);
+  if (res < 0) {
+    if (errno == EAGAIN) {
+      return;
+    }
+    /* the bytes are lost, as on a line without a receiver */
+    res = n;
   }
-  if (data & SERIAL_XMT_RDY_IEN) {
-    serialControl_0 |= SERIAL_XMT_RDY_IEN;
-  } else {
-    serialControl_0 &= ~SERIAL_XMT_RDY_IEN;
+  __atomic_store_n(&h->xmt.tail, tail + res, __ATOMIC_SEQ_CST);
+}
+
+
+static void *serialThread(void *arg) {
+  SerialHost *h;
+  struct pollfd pfd[2];
+  Bool connected;
+  char buf[16];
+  unsigned tail;
+
+  h = arg;
+  connected = true;
+  while (!__atomic_load_n(&h->stop, __ATOMIC_SEQ_CST)) {
+    __atomic_store_n(&h->waiting, true, __ATOMIC_SEQ_CST);
+    pfd[0].fd = connected ? h->fd : -1;
+    pfd[0].events = 0;
+    if (ringUsed(&h->rcv) < SERIAL_RING_SIZE) {
+      pfd[0].events |= POLLIN;
+    }
+    if (ringUsed(&h->xmt) > 0) {
+      pfd[0].events |= POLLOUT;
+    }
+    pfd[0].revents = 0;
+    pfd[1].fd = h->wake[0];
+    pfd[1].events = POLLIN;
+    pfd[1].revents = 0;
+    if (poll(pfd, 2, connected ? -1 : SERIAL_HUP_WAIT) < 0) {
+      continue;
+    }
+    __atomic_store_n(&h->waiting, false, __ATOMIC_SEQ_CST);
+    if (pfd[1].revents & POLLIN) {
+      while (read(h->wake[0], buf, sizeof(buf)) > 0) ;
+    }
+    connected = true;
+    if (pfd[0].revents & POLLOUT) {
+      serialTransmit(h);
+    }
+    if (pfd[0].revents & (POLLIN | POLLHUP)) {
+      /* after a hangup, look again a little later */
+      connected = serialReceive(h) && !(pfd[0].revents & POLLHUP);
+    }
   }
-  if (data & SERIAL_XMT_EMPTY_IEN) {
-    serialControl_0 |= SERIAL_XMT_EMPTY_IEN;
-  } else {
-    serialControl_0 &= ~SERIAL_XMT_EMPTY_IEN;
+  /* send what is left, as far as the line takes it */
+  do {
+    tail = h->xmt.tail;
+    serialTransmit(h);
+  } while (ringUsed(&h->xmt) > 0 && h->xmt.tail != tail);
+  return NULL;
+}
+
+
+static void serialStart(SerialHost *h, int fd) {
+  h->fd = fd;
+  if (pipe(h->wake) < 0) {
+    error("cannot create pipe for serial line");
   }
-  if (((serialControl_0 & SERIAL_XMT_RDY_IEN) &&
-       (serialStatus_0 & SERIAL_XMT_RDY)) ||
-      ((serialControl_0 & SERIAL_XMT_EMPTY_IEN) &&
-       (serialStatus_0 & SERIAL_XMT_EMPTY))) {
-    cpuSetInterrupt(IRQ_RS232_0_XMT);
-  } else {
-    cpuResetInterrupt(IRQ_RS232_0_XMT);
+  fcntl(h->wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(h->wake[1], F_SETFL, O_NONBLOCK);
+  h->stop = false;
+  h->waiting = false;
+  if (pthread_create(&h->thread, NULL, serialThread, h) != 0) {
+    error("cannot start host thread for serial line");
   }
-  /* ignore setting the baud rate in simulation */
+  h->running = true;
 }
 
 
-void initRS232_0(void) {
-  int master;
-  char slavePath[100];
-  FILE *serdevFile;
+static void serialStop(SerialHost *h) {
+  char c;
 
-  serialIn_0 = NULL;
-  serialOut_0 = NULL;
-  master = open("/dev/ptmx", O_RDWR | O_NONBLOCK);
-  if (master < 0) {
-    error("cannot open pseudo terminal master for serial line");
+  if (!h->running) {
+    return;
   }
-  grantpt(master);
-  unlockpt(master);
-  strcpy(slavePath, ptsname(master));
-  printf("Serial line 0 can be accessed by opening device '%s'.\n",
-         slavePath);
-  serdevFile = fopen(SERDEV_FILE, "w");
-  if (serdevFile == NULL) {
-    error("cannot open file for writing serial device path");
+  __atomic_store_n(&h->stop, true, __ATOMIC_SEQ_CST);
+  c = 0;
+  if (write(h->wake[1], &c, 1) < 0) {
+    /* the pipe is full, the thread wakes up anyway */
   }
-  fprintf(serdevFile, "%s\n", slavePath);
-  fclose(serdevFile);
-  printf("This path was also written to file '%s'.\n", SERDEV_FILE);
-  fcntl(master, F_SETFL, O_NONBLOCK);
-  serialIn_0 = fdopen(master, "r");
-  setvbuf(serialIn_0, NULL, _IONBF, 0);
-  serialOut_0 = fdopen(master, "w");
-  setvbuf(serialOut_0, NULL, _IONBF, 0);
-  while (fgetc(serialIn_0) != EOF) ;
-  serialStatus_0 = SERIAL_XMT_RDY | SERIAL_XMT_EMPTY;
-  serialControl_0 = 0;
+  pthread_join(h->thread, NULL);
+  close(h->wake[0]);
+  close(h->wake[1]);
+  close(h->fd);
+  h->running = false;
+}
+
+
+/*
+ * after fork(), the host thread is gone in the child:
+ * forget it, and start a new one on the same line
+ */
+static void serialRevive(SerialHost *h) {
+  if (!h->running) {
+    return;
+  }
+  close(h->wake[0]);
+  close(h->wake[1]);
+  serialStart(h, h->fd);
+}
+
+
+/*
+ * as above, but for a fresh pseudo terminal,
+ * with nothing in transit on the new line
+ */
+static void serialReplace(SerialHost *h, int fd) {
+  if (h->running) {
+    close(h->wake[0]);
+    close(h->wake[1]);
+    close(h->fd);
+  }
+  h->rcv.head = h->rcv.tail = 0;
+  h->xmt.head = h->xmt.tail = 0;
+  serialStart(h, fd);
+}
+
+
+/**************************************************************/
+
+/*
+ * I/O devices 2, 3: RS232 0
+ */
+
+
+#define SERIAL_RCV_RDY		0x01
+#define SERIAL_XMT_RDY		0x02
+#define SERIAL_XMT_EMPTY	0x04
+
+#define SERIAL_RCV_RDY_IEN	0x01
+#define SERIAL_XMT_RDY_IEN	0x02
+#define SERIAL_XMT_EMPTY_IEN	0x04
+
+#define SERIAL_SET_BAUD		0x80000000
+#define SERIAL_BAUD_SHIFT	28
+#define SERIAL_BAUD_MASK	0x07
+
+#define SERIAL_BAUD_INF		0		/* no time per character */
+#define SERIAL_POLL_INF		(INST_PER_MSEC / 10)
+
+
+/*
+ * speed of the serial lines
+ *     Each line starts at serialBaud, and changes its rate
+ *     when the program sets it. With "-baud inf", a character
+ *     takes no time at all: it is sent in the next instruction,
+ *     and is received as soon as the host supplies it.
+ */
+static int serialBaud = BAUD_RATE;
+
+static Word serialBaudTable[8] = {
+  2400, 4800, 9600, 19200, 31250, 38400, 57600, 115200,
+};
+
+
+/*
+ * rate: "inf", or a number of bits per second
+ */
+void serialSetBaud(char *rate) {
+  char *endp;
+
+  if (strcmp(rate, "inf") == 0) {
+    serialBaud = SERIAL_BAUD_INF;
+    return;
+  }
+  serialBaud = strtol(rate, &endp, 10);
+  if (*endp != '\0' || serialBaud < 1) {
+    error("illegal baud rate '%s'", rate);
+  }
+}
+
+
+/*
+ * instructions per character (10 bits) at the given baud
+ * rate; a received character is looked for that often,
+ * but at least every SERIAL_POLL_INF instructions
+ */
+static Time serialCharTime(Word baud) {
+  if (serialBaud == SERIAL_BAUD_INF) {
+    return 0;
+  }
+  return (Time) (INST_PER_MSEC * 10 * (1000.0 / baud) + 0.5);
+}
+
+
+static Time serialPollTime(Word baud) {
+  if (serialBaud == SERIAL_BAUD_INF) {
+    return SERIAL_POLL_INF;
+  }
+  return serialCharTime(baud);
+}
+
+
+static PER_MACHINE SerialHost serialHost_0;
+static PER_MACHINE Word serialRcvData_0;
+static PER_MACHINE Word serialXmtData_0;
+static PER_MACHINE Word serialStatus_0;
+static PER_MACHINE Word serialControl_0;
+static PER_MACHINE Word serialRate_0;	/* baud */
+
+
+static PER_MACHINE Event emptyEvent_0;
+
+
+static void fetchRS232_0(void) {
+  Byte c;
+
+  if (serialGet(&serialHost_0, &c)) {
+    serialRcvData_0 = c;
+    serialStatus_0 |= SERIAL_RCV_RDY;
+    if (serialControl_0 & SERIAL_RCV_RDY_IEN) {
+      cpuSetInterrupt(IRQ_RS232_0_RCV);
+    }
+  }
+}
+
+
+static void receiveRS232_0(Event *ev) {
+  /* the line is polled every serialPollTime() + 1 instructions */
+  eventSchedule(ev, simTime + serialPollTime(serialRate_0) + 1);
+  if (serialBaud == SERIAL_BAUD_INF &&
+      (serialStatus_0 & SERIAL_RCV_RDY) != 0) {
+    /* at full speed, the host waits for the program */
+    return;
+  }
+  fetchRS232_0();
+}
+
+
+static void transmitRS232_0(Event *ev) {
+  if (!serialPut(&serialHost_0, serialXmtData_0 & 0xFF) &&
+      serialBaud == SERIAL_BAUD_INF) {
+    /* at full speed, the program waits for the host */
+    serialKick(&serialHost_0);
+    eventSchedule(ev, simTime + SERIAL_POLL_INF + 1);
+    return;
+  }
+  /* else lost if the host is far behind, as on a full line */
+  serialStatus_0 |= SERIAL_XMT_RDY;
+  if (serialControl_0 & SERIAL_XMT_RDY_IEN) {
+    cpuSetInterrupt(IRQ_RS232_0_XMT);
+  }
+  // one character delay until transmitter empty
+  eventSchedule(&emptyEvent_0, simTime + serialCharTime(serialRate_0) + 1);
+}
+
+
+static void emptyRS232_0(Event *ev) {
+  /* end of a burst: hand it over to the host */
+  serialKick(&serialHost_0);
+  serialStatus_0 |= SERIAL_XMT_EMPTY;
+  if (serialControl_0 & SERIAL_XMT_EMPTY_IEN) {
+    cpuSetInterrupt(IRQ_RS232_0_XMT);
+  }
+}
+
+
+static PER_MACHINE Event rcvEvent_0 = { "RS232 0 receive", receiveRS232_0, 0, 0, -1 };
+static PER_MACHINE Event xmtEvent_0 = { "RS232 0 transmit", transmitRS232_0, 0, 0, -1 };
+static PER_MACHINE Event emptyEvent_0 = { "RS232 0 empty", emptyRS232_0, 0, 0, -1 };
+
+
+/*
+ * read device 2:
+ *     receiver data
+ *     { 24'bx, rcv_data[7:0] }
+ */
+Word readRS232data_0(void) {
+  serialStatus_0 &= ~SERIAL_RCV_RDY;
+  if (serialControl_0 & SERIAL_RCV_RDY_IEN) {
+    cpuResetInterrupt(IRQ_RS232_0_RCV);
+  }
+  return serialRcvData_0;
+}
+
+
+/*
+ * write device 2:
+ *     transmitter data
+ *     { 24'bx, xmt_data[7:0] }
+ */
+void writeRS232data_0(Word data) {
+  if (serialStatus_0 & SERIAL_XMT_RDY) {
+    /* transmitter idle: start sending */
+    eventSchedule(&xmtEvent_0, simTime + serialCharTime(serialRate_0) + 1);
+  }
+  eventCancel(&emptyEvent_0);
+  serialXmtData_0 = data & 0xFF;
+  serialStatus_0 &= ~(SERIAL_XMT_RDY | SERIAL_XMT_EMPTY);
+  if (serialControl_0 & (SERIAL_XMT_RDY_IEN | SERIAL_XMT_EMPTY_IEN)) {
+    cpuResetInterrupt(IRQ_RS232_0_XMT);
+  }
+}
+
+
+/*
+ * read device 3:
+ *     status
+ *     { 29'bx, xmt_empty, xmt_rdy, rcv_rdy }
+ */
+Word readRS232ctrl_0(void) {
+  if (serialBaud == SERIAL_BAUD_INF &&
+      (serialStatus_0 & SERIAL_RCV_RDY) == 0) {
+    /* at full speed, do not wait for the next poll */
+    fetchRS232_0();
+  }
+  return serialStatus_0;
+}
+
+
+/*
+ * write device 3:
+ *     control
+ *     { set_baud, baud[2:0], 25'bx,
+ *       xmt_empty_ien, xmt_rdy_ien, rcv_rdy_ien }
+ *     baud    baud rate
+ *     000     2400
+ *     001     4800
+ *     010     9600    (default)
+ *     011     19200
+ *     100     31250   (for MIDI)
+ *     101     38400
+ *     110     57600
+ *     111     115200
+ */
+void writeRS232ctrl_0(Word data) {
+  /* handle interrupt control */
+  if (data & SERIAL_RCV_RDY_IEN) {
+    serialControl_0 |= SERIAL_RCV_RDY_IEN;
+  } else {
+    serialControl_0 &= ~SERIAL_RCV_RDY_IEN;
+  }
+  if ((serialControl_0 & SERIAL_RCV_RDY_IEN) &&
+      (serialStatus_0 & SERIAL_RCV_RDY)) {
+    cpuSetInterrupt(IRQ_RS232_0_RCV);
+  } else {
+    cpuResetInterrupt(IRQ_RS232_0_RCV);
+  }
+  if (data & SERIAL_XMT_RDY_IEN) {
+    serialControl_0 |= SERIAL_XMT_RDY_IEN;
+  } else {
+    serialControl_0 &= ~SERIAL_XMT_RDY_IEN;
+  }
+  if (data & SERIAL_XMT_EMPTY_IEN) {
+    serialControl_0 |= SERIAL_XMT_EMPTY_IEN;
+  } else {
+    serialControl_0 &= ~SERIAL_XMT_EMPTY_IEN;
+  }
+  if (((serialControl_0 & SERIAL_XMT_RDY_IEN) &&
+       (serialStatus_0 & SERIAL_XMT_RDY)) ||
+      ((serialControl_0 & SERIAL_XMT_EMPTY_IEN) &&
+       (serialStatus_0 & SERIAL_XMT_EMPTY))) {
+    cpuSetInterrupt(IRQ_RS232_0_XMT);
+  } else {
+    cpuResetInterrupt(IRQ_RS232_0_XMT);
+  }
+  /* set the baud rate, takes effect with the next character */
+  if (data & SERIAL_SET_BAUD) {
+    serialRate_0 =
+      serialBaudTable[(data >> SERIAL_BAUD_SHIFT) & SERIAL_BAUD_MASK];
+  }
+}
+
+
+void initRS232_0(void) {
+  int master;
+  char slavePath[100];
+  FILE *serdevFile;
+  char buf[64];
+
+  master = open("/dev/ptmx", O_RDWR | O_NONBLOCK);
+  if (master < 0) {
+    error("cannot open pseudo terminal master for serial line");
+  }
+  grantpt(master);
+  unlockpt(master);
+  strcpy(slavePath, ptsname(master));
+  printf("Serial line 0 can be accessed by opening device '%s'.\n",
+         slavePath);
+  serdevFile = fopen(SERDEV_FILE, "w");
+  if (serdevFile == NULL) {
+    error("cannot open file for writing serial device path");
+  }
+  fprintf(serdevFile, "%s\n", slavePath);
+  fclose(serdevFile);
+  printf("This path was also written to file '%s'.\n", SERDEV_FILE);
+  fcntl(master, F_SETFL, O_NONBLOCK);
+  while (read(master, buf, sizeof(buf)) > 0) ;
+  serialHost_0.rcv.head = serialHost_0.rcv.tail = 0;
+  serialHost_0.xmt.head = serialHost_0.xmt.tail = 0;
+  serialStart(&serialHost_0, master);
+  serialStatus_0 = SERIAL_XMT_RDY | SERIAL_XMT_EMPTY;
+  serialControl_0 = 0;
+  serialRate_0 = serialBaud != SERIAL_BAUD_INF ? serialBaud : BAUD_RATE;
+  eventSchedule(&rcvEvent_0, simTime + serialPollTime(serialRate_0) + 1);
+}
+
+
+void exitRS232_0(void) {
+  serialStop(&serialHost_0);
+}
+
+
+/*
+ * connect line 0 to a fresh pseudo terminal, leaving the
+ * state of the line as it is (used by batch mode children)
+ */
+void reopenRS232_0(char *slavePath) {
+  int master;
+
+  master = open("/dev/ptmx", O_RDWR | O_NONBLOCK);
+  if (master < 0) {
+    error("cannot open pseudo terminal master for serial line");
+  }
+  grantpt(master);
+  unlockpt(master);
+  strcpy(slavePath, ptsname(master));
+  serialReplace(&serialHost_0, master);
 }
 
 
@@ -420,73 +1065,257 @@ static Bool debugDiskSectorOp = false;
 static Bool debugDiskCommand = false;
 static Bool debugDiskRdWrWord = false;
 
-static FILE *diskImage;
-static int diskState;
-static Word diskOffset;
-static Word diskRxBuf[128];
-static int diskRxIdx;
-static Word diskTxBuf[128 + 2];
-static int diskTxCnt;
-static int diskTxIdx;
-
-static Byte csd[16] = {
+static PER_MACHINE int diskFd = -1;
+static PER_MACHINE Byte *diskMap;	/* the image, mapped into memory */
+static PER_MACHINE Word diskSectors;	/* number of sectors in the image */
+static PER_MACHINE int diskState;
+static PER_MACHINE Word diskOffset;
+static PER_MACHINE Word diskRxBuf[128];
+static PER_MACHINE int diskRxIdx;
+static PER_MACHINE Word diskTxBuf[128 + 2];
+static PER_MACHINE int diskTxCnt;
+static PER_MACHINE int diskTxIdx;
+static PER_MACHINE Bool diskTxMapped;	/* data words come from the map */
+static PER_MACHINE Word diskSector;	/* sector to be read or written next */
+static PER_MACHINE Bool diskMulti;	/* CMD18 or CMD25 in progress */
+static PER_MACHINE Word diskBlocks;	/* blocks written by CMD25 so far */
+
+static PER_MACHINE Byte csd[16] = {
   0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, 0x00,
   0x00, 0x00, 0x7F, 0x80, 0x0A, 0x40, 0x40, 0xC3,
 };
 
 
-static void diskSeekSector(Word secnum) {
-  if (debugDiskSectorOp) {
-    printf("DISK: seek to sector 0x%08X\n", secnum);
+/*
+ * msync policy for the mapped disk image
+ *     never: leave writing back to the kernel
+ *     exit: sync when the disk is closed
+ *     periodic: start writing back every diskSyncSecs
+ *               seconds of simulated time, and at exit
+ */
+
+
+#define DISK_SYNC_NEVER		0
+#define DISK_SYNC_EXIT		1
+#define DISK_SYNC_PERIODIC	2
+
+
+static int diskSyncPolicy = DISK_SYNC_NEVER;
+static int diskSyncSecs;
+
+/*
+ * private: when enabled, the disk image is mapped copy-on-write,
+ * so written sectors stay in this process
+ */
+static PER_MACHINE Bool diskPrivate = false;
+
+
+/*
+ * overlay disk, selected by "-d <base>:<overlay>"
+ *     The base image is only read. Written sectors go to the
+ *     overlay file: a header, a bitmap with one bit per sector
+ *     (set if the sector is in the overlay), and the sectors,
+ *     each one at its place in the base image plus dataOffset.
+ *     The file is sparse, so only written sectors take up space
+ *     on the host. The overlay is created if it does not exist.
+ *     tools/ovldisk commits an overlay into its base, or
+ *     discards it.
+ */
+
+
+#define OVL_MAGIC	0x594C564F	/* 'OVLY' */
+#define OVL_VERSION	1
+#define OVL_BITMAP	4096		/* file offset of the bitmap */
+#define OVL_ALIGN	4096		/* sector data is page-aligned */
+
+
+typedef struct {
+  Word magic;
+  Word version;
+  Word sectors;			/* number of sectors in the base */
+  Word dataOffset;		/* file offset of sector 0 */
+  long long baseSize;		/* size of the base image */
+  long long baseMTime;		/* nanoseconds */
+} OvlHeader;
+
+
+static PER_MACHINE int ovlFd = -1;
+static PER_MACHINE Byte *ovlMap;	/* the overlay, NULL if none */
+static PER_MACHINE size_t ovlSize;
+static PER_MACHINE Word ovlDataOffset;
+
+
+static Byte *diskSectorData(Word secnum) {
+  if (ovlMap != NULL &&
+      (ovlMap[OVL_BITMAP + secnum / 8] & (1 << (secnum % 8))) != 0) {
+    return ovlMap + ovlDataOffset + (size_t) secnum * 512;
+  }
+  return diskMap + (size_t) secnum * 512;
+}
+
+
+static Byte *diskSectorDest(Word secnum) {
+  if (ovlMap != NULL) {
+    return ovlMap + ovlDataOffset + (size_t) secnum * 512;
   }
-  if (diskImage == NULL) {
+  return diskMap + (size_t) secnum * 512;
+}
+
+
+static void diskSyncMap(int flags) {
+  int res;
+
+  if (diskPrivate) {
+    /* nothing to write back */
     return;
   }
-  fseek(diskImage, secnum * 512, SEEK_SET);
+  if (ovlMap != NULL) {
+    res = msync(ovlMap, ovlSize, flags);
+  } else {
+    res = msync(diskMap, (size_t) diskSectors * 512, flags);
+  }
+  if (res < 0) {
+    warning("cannot sync disk image");
+  }
 }
 
 
-static void diskReadSector(Word *buf) {
-  Byte bytes[512];
-  int i;
+static void diskSync(Event *ev) {
+  if (diskMap == NULL) {
+    return;
+  }
+  diskSyncMap(MS_ASYNC);
+}
+
+
+static PER_MACHINE Event diskSyncEvent = { "disk sync", diskSync, 0, 0, -1 };
+
+
+/*
+ * the SD card transfers little-endian words,
+ * whatever the byte order of the host may be
+ */
+static Word diskGetWord(Byte *p) {
+  return (Word) p[0] <<  0 |
+         (Word) p[1] <<  8 |
+         (Word) p[2] << 16 |
+         (Word) p[3] << 24;
+}
+
 
+static void diskPutWord(Byte *p, Word w) {
+  p[0] = w >>  0;
+  p[1] = w >>  8;
+  p[2] = w >> 16;
+  p[3] = w >> 24;
+}
+
+
+/*
+ * a sector beyond the end of the image is not an error
+ * of the simulator: the card reports it to the guest
+ */
+static Bool diskSeekSector(Word secnum) {
   if (debugDiskSectorOp) {
-    printf("DISK: read sector\n");
+    printf("DISK: seek to sector 0x%08X\n", secnum);
   }
-  if (diskImage == NULL) {
-    return;
+  if (diskMap == NULL) {
+    return true;
   }
-  if (fread(bytes, 512, 1, diskImage) != 1) {
-    error("read error on disk image");
+  diskSector = secnum;
+  return secnum < diskSectors;
+}
+
+
+/*
+ * the data words of a read are taken from the map
+ * by diskRead(), one at a time, without copying
+ */
+static void diskReadSector(void) {
+  if (debugDiskSectorOp) {
+    printf("DISK: read sector\n");
   }
-  for (i = 0; i < 128; i++) {
-    buf[i] = (Word) bytes[4 * i + 0] <<  0 |
-             (Word) bytes[4 * i + 1] <<  8 |
-             (Word) bytes[4 * i + 2] << 16 |
-             (Word) bytes[4 * i + 3] << 24;
+  diskTxMapped = (diskMap != NULL);
+}
+
+
+/*
+ * a sector has been completely stored into the map
+ */
+static void diskSectorWritten(Word secnum) {
+  if (ovlMap != NULL) {
+    /* the sector is complete, let it be seen */
+    ovlMap[OVL_BITMAP + secnum / 8] |= 1 << (secnum % 8);
+  }
+  if (diskSyncPolicy == DISK_SYNC_PERIODIC &&
+      diskSyncEvent.slot < 0) {
+    eventSchedule(&diskSyncEvent,
+                  simTime + (Time) diskSyncSecs * 1000 * INST_PER_MSEC);
   }
 }
 
 
-static void diskWriteSector(Word *buf) {
-  Byte bytes[512];
+/*
+ * the data words of a write have been collected in
+ * diskRxBuf by diskWrite(); only a complete block is
+ * stored into the map, as a real card would do it
+ */
+static void diskWriteSector(void) {
+  Byte *p;
   int i;
 
   if (debugDiskSectorOp) {
     printf("DISK: write sector\n");
   }
-  if (diskImage == NULL) {
+  if (diskMap == NULL || diskSector >= diskSectors) {
     return;
   }
+  p = diskSectorDest(diskSector);
   for (i = 0; i < 128; i++) {
-    bytes[4 * i + 0] = buf[i] >>  0;
-    bytes[4 * i + 1] = buf[i] >>  8;
-    bytes[4 * i + 2] = buf[i] >> 16;
-    bytes[4 * i + 3] = buf[i] >> 24;
+    diskPutWord(p, diskRxBuf[i]);
+    p += 4;
+  }
+  diskSectorWritten(diskSector);
+}
+
+
+/*
+ * a multiple block read sends, for each block, a start
+ * token, 128 data words, and 2 checksum bytes, until
+ * it is stopped by CMD12; a block beyond the end of the
+ * image is answered by an out-of-range error token
+ */
+#define DISK_FRAME	(1 + 128 + 2)
+#define DISK_OUT_OF_RANGE	0x08	/* data error token */
+
+
+static Word diskReadStream(int idx) {
+  Word secnum;
+  int k;
+
+  secnum = diskSector + idx / DISK_FRAME;
+  k = idx % DISK_FRAME;
+  if (diskMap != NULL && secnum >= diskSectors) {
+    return k == 0 ? DISK_OUT_OF_RANGE : 255;
+  }
+  if (k == 0) {
+    return 254;
   }
-  if (fwrite(bytes, 512, 1, diskImage) != 1) {
-    error("write error on disk image");
+  if (k > 128 || diskMap == NULL) {
+    return 255;
   }
+  return diskGetWord(diskSectorData(secnum) + (k - 1) * 4);
+}
+
+
+/*
+ * R1 response with the address error bit set,
+ * the command is not executed
+ */
+static void diskAddressError(void) {
+  diskState = DISK_CMD;
+  diskTxBuf[0] = 0x20;
+  diskTxCnt = 1;
 }
 
 
@@ -503,6 +1332,8 @@ static void diskRunCmd(void) {
   if (debugDiskCommand) {
     printf("DISK: cmd = 0x%02X, arg = 0x%08X\n", cmd, arg);
   }
+  diskTxMapped = false;
+  diskMulti = false;
   switch (cmd) {
     case 64+9:
       /* CMD9: send CSD */
@@ -516,17 +1347,53 @@ static void diskRunCmd(void) {
       break;
     case 64+17:
       /* CMD17: read single block */
+      if (!diskSeekSector(arg - diskOffset)) {
+        diskAddressError();
+        break;
+      }
       diskState = DISK_READ;
       diskTxBuf[0] = 0;
       diskTxBuf[1] = 254;
-      diskSeekSector(arg - diskOffset);
-      diskReadSector(diskTxBuf + 2);
+      diskReadSector();
       diskTxCnt = 2 + 128;
       break;
+    case 64+18:
+      /* CMD18: read multiple blocks */
+      if (!diskSeekSector(arg - diskOffset)) {
+        diskAddressError();
+        break;
+      }
+      diskState = DISK_READ;
+      diskMulti = true;
+      diskTxBuf[0] = 0;
+      diskTxCnt = 1;
+      break;
+    case 64+12:
+      /* CMD12: stop transmission, after a stuff byte */
+      diskState = DISK_CMD;
+      diskTxBuf[0] = 255;
+      diskTxBuf[1] = 0;
+      diskTxCnt = 2;
+      break;
     case 64+24:
       /* CMD24: write single block */
+      if (!diskSeekSector(arg - diskOffset)) {
+        diskAddressError();
+        break;
+      }
+      diskState = DISK_WRT0;
+      diskTxBuf[0] = 0;
+      diskTxCnt = 1;
+      break;
+    case 64+25:
+      /* CMD25: write multiple blocks */
+      if (!diskSeekSector(arg - diskOffset)) {
+        diskAddressError();
+        break;
+      }
       diskState = DISK_WRT0;
-      diskSeekSector(arg - diskOffset);
+      diskMulti = true;
+      diskBlocks = 0;
       diskTxBuf[0] = 0;
       diskTxCnt = 1;
       break;
@@ -543,8 +1410,16 @@ static void diskRunCmd(void) {
 static Word diskRead(void) {
   Word result;
 
+  if (diskMulti && diskState == DISK_READ && diskTxIdx >= 1) {
+    result = diskReadStream(diskTxIdx - 1);
+  } else
   if (diskTxIdx >= 0 && diskTxIdx < diskTxCnt) {
-    result = diskTxBuf[diskTxIdx];
+    if (diskTxMapped && diskTxIdx >= 2) {
+      result = diskGetWord(diskSectorData(diskSector) +
+                           (diskTxIdx - 2) * 4);
+    } else {
+      result = diskTxBuf[diskTxIdx];
+    }
   } else {
     result = 255;
   }
@@ -555,6 +1430,18 @@ static Word diskRead(void) {
 }
 
 
+static void diskCollectCmd(Word value) {
+  if ((value & 0xFF) != 0xFF || diskRxIdx != 0) {
+    diskRxBuf[diskRxIdx] = value;
+    diskRxIdx++;
+    if (diskRxIdx == 6) {
+      diskRunCmd();
+      diskRxIdx = 0;
+    }
+  }
+}
+
+
 static void diskWrite(Word value) {
   if (debugDiskRdWrWord) {
     printf("DISK: write, value = 0x%08X, state = %d\n",
@@ -563,25 +1450,41 @@ static void diskWrite(Word value) {
   diskTxIdx++;
   switch (diskState) {
     case DISK_CMD:
-      if ((value & 0xFF) != 0xFF || diskRxIdx != 0) {
-        diskRxBuf[diskRxIdx] = value;
-        diskRxIdx++;
-        if (diskRxIdx == 6) {
-          diskRunCmd();
-          diskRxIdx = 0;
-        }
-      }
+      diskCollectCmd(value);
       break;
     case DISK_READ:
+      if (diskMulti) {
+        /* the data keep coming until CMD12 arrives */
+        diskCollectCmd(value);
+      } else
       if (diskTxIdx == diskTxCnt) {
         diskState = DISK_CMD;
         diskTxCnt = 0;
         diskTxIdx = 0;
+        diskTxMapped = false;
       }
       break;
     case DISK_WRT0:
-      if (value == 254) {
+      if (!diskMulti) {
+        if (value == 254) {
+          diskState = DISK_WRT1;
+        }
+      } else
+      if (value == 252) {
+        /* next block of CMD25 */
+        if (diskBlocks > 0) {
+          diskSeekSector(diskSector + 1);
+        }
+        diskBlocks++;
         diskState = DISK_WRT1;
+      } else
+      if (value == 253) {
+        /* stop token of CMD25, then a stuff byte */
+        diskMulti = false;
+        diskTxBuf[0] = 255;
+        diskTxCnt = 1;
+        diskTxIdx = -1;
+        diskState = DISK_CMD;
       }
       break;
     case DISK_WRT1:
@@ -590,52 +1493,155 @@ static void diskWrite(Word value) {
       }
       diskRxIdx++;
       if (diskRxIdx == 128) {
-        diskWriteSector(diskRxBuf);
+        diskWriteSector();
       }
       if (diskRxIdx == 130) {
-        diskTxBuf[0] = 5;
+        /* data accepted, or write error beyond the end */
+        diskTxBuf[0] = diskMap == NULL || diskSector < diskSectors ? 5 : 13;
         diskTxCnt = 1;
         diskTxIdx = -1;
         diskRxIdx = 0;
-        diskState = DISK_CMD;
+        diskState = diskMulti ? DISK_WRT0 : DISK_CMD;
       }
       break;
   }
 }
 
 
+/*
+ * policy: "never", "exit", or a number of seconds
+ */
+void diskSetSync(char *policy) {
+  char *endp;
+
+  if (strcmp(policy, "never") == 0) {
+    diskSyncPolicy = DISK_SYNC_NEVER;
+    return;
+  }
+  if (strcmp(policy, "exit") == 0) {
+    diskSyncPolicy = DISK_SYNC_EXIT;
+    return;
+  }
+  diskSyncSecs = strtol(policy, &endp, 10);
+  if (*endp != '\0' || diskSyncSecs < 1) {
+    error("illegal disk sync policy '%s'", policy);
+  }
+  diskSyncPolicy = DISK_SYNC_PERIODIC;
+}
+
+
+static long long fileMTime(struct stat *st) {
+  return (long long) st->st_mtim.tv_sec * 1000000000 +
+         st->st_mtim.tv_nsec;
+}
+
+
+static void ovlInit(char *ovlName, char *baseName, struct stat *baseSt) {
+  OvlHeader hdr;
+
+  ovlDataOffset = OVL_BITMAP +
+                  ((diskSectors + 7) / 8 + OVL_ALIGN - 1) / OVL_ALIGN *
+                  OVL_ALIGN;
+  ovlSize = ovlDataOffset + (size_t) diskSectors * 512;
+  ovlFd = open(ovlName, O_RDWR);
+  if (ovlFd < 0) {
+    /* a new overlay, empty and sparse */
+    ovlFd = open(ovlName, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (ovlFd < 0) {
+      error("cannot create overlay file '%s'", ovlName);
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = OVL_MAGIC;
+    hdr.version = OVL_VERSION;
+    hdr.sectors = diskSectors;
+    hdr.dataOffset = ovlDataOffset;
+    hdr.baseSize = baseSt->st_size;
+    hdr.baseMTime = fileMTime(baseSt);
+    if (write(ovlFd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        ftruncate(ovlFd, ovlSize) < 0) {
+      error("cannot write overlay file '%s'", ovlName);
+    }
+  } else
+  if (read(ovlFd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      hdr.magic != OVL_MAGIC || hdr.version != OVL_VERSION) {
+    error("file '%s' is not a disk overlay", ovlName);
+  } else
+  if (hdr.sectors != diskSectors ||
+      hdr.dataOffset != ovlDataOffset ||
+      hdr.baseSize != baseSt->st_size) {
+    error("overlay '%s' does not belong to disk image '%s'",
+          ovlName, baseName);
+  } else
+  if (hdr.baseMTime != fileMTime(baseSt)) {
+    error("disk image '%s' has changed since overlay '%s' was made",
+          baseName, ovlName);
+  }
+  ovlMap = mmap(NULL, ovlSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                ovlFd, 0);
+  if (ovlMap == MAP_FAILED) {
+    error("cannot map overlay file '%s'", ovlName);
+  }
+}
+
+
 void diskInit(char *diskName) {
-  long numBytes;
-  Word numSectors;
+  char *baseName;
+  char *ovlName;
+  struct stat st;
   Word csize;
 
   if (diskName == NULL) {
-    diskImage = NULL;
+    diskMap = NULL;
     return;
   }
-  diskImage = fopen(diskName, "r+");
-  if (diskImage == NULL) {
-    error("cannot open disk file '%s'", diskName);
+  /* "<base>:<overlay>" selects an overlay disk */
+  baseName = malloc(strlen(diskName) + 1);
+  if (baseName == NULL) {
+    error("out of memory");
+  }
+  strcpy(baseName, diskName);
+  ovlName = strrchr(baseName, ':');
+  if (ovlName != NULL) {
+    *ovlName++ = '\0';
+  }
+  diskFd = open(baseName, ovlName != NULL ? O_RDONLY : O_RDWR);
+  if (diskFd < 0) {
+    error("cannot open disk file '%s'", baseName);
   }
   /* determine disk capacity and set CSD */
-  fseek(diskImage, 0, SEEK_END);
-  numBytes = ftell(diskImage);
-  fseek(diskImage, 0, SEEK_SET);
-  if (numBytes % (1024 * 512) != 0) {
+  if (fstat(diskFd, &st) < 0) {
+    error("cannot stat disk file '%s'", baseName);
+  }
+  if (st.st_size % (1024 * 512) != 0) {
     printf("Warning: disk image '%s' is not "
            "a multiple of 1024 sectors.\n",
-           diskName);
+           baseName);
+  }
+  diskSectors = st.st_size / 512;
+  if (diskSectors == 0) {
+    error("disk image '%s' is too small", baseName);
+  }
+  diskMap = mmap(NULL, (size_t) diskSectors * 512,
+                 ovlName != NULL ? PROT_READ : PROT_READ | PROT_WRITE,
+                 MAP_SHARED, diskFd, 0);
+  if (diskMap == MAP_FAILED) {
+    error("cannot map disk file '%s'", baseName);
+  }
+  if (ovlName != NULL) {
+    ovlInit(ovlName, baseName, &st);
   }
-  numSectors = numBytes / 512;
-  csize = numSectors / 1024 - 1;
+  free(baseName);
+  csize = diskSectors / 1024 - 1;
   csd[7] = (csize >> 16) & 0x3F;
   csd[8] = (csize >>  8) & 0xFF;
   csd[9] = (csize >>  0) & 0xFF;
   /* init SD card controller */
   diskState = DISK_CMD;
-  diskSeekSector(0);
-  diskReadSector(diskTxBuf);
-  if (diskTxBuf[0] == 0x9B1EA38D) {
+  diskSector = 0;
+  diskTxMapped = false;
+  diskMulti = false;
+  diskBlocks = 0;
+  if (diskGetWord(diskSectorData(0)) == 0x9B1EA38D) {
     diskOffset = 0x80002;
   } else {
     diskOffset = 0;
@@ -646,6 +1652,53 @@ void diskInit(char *diskName) {
 }
 
 
+/*
+ * from now on, keep disk writes private to this process
+ * (which may share the disk image with others after fork)
+ */
+void diskMakePrivate(void) {
+  if (diskMap == NULL) {
+    return;
+  }
+  /* replace the shared mapping in place */
+  if (ovlMap != NULL) {
+    if (mmap(ovlMap, ovlSize,
+             PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+             ovlFd, 0) == MAP_FAILED) {
+      error("cannot map disk overlay privately");
+    }
+  } else
+  if (mmap(diskMap, (size_t) diskSectors * 512,
+           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+           diskFd, 0) == MAP_FAILED) {
+    error("cannot map disk image privately");
+  }
+  diskPrivate = true;
+}
+
+
+void diskExit(void) {
+  if (diskMap == NULL) {
+    return;
+  }
+  eventCancel(&diskSyncEvent);
+  if (diskSyncPolicy != DISK_SYNC_NEVER) {
+    diskSyncMap(MS_SYNC);
+  }
+  if (ovlMap != NULL) {
+    munmap(ovlMap, ovlSize);
+    close(ovlFd);
+    ovlMap = NULL;
+    ovlFd = -1;
+  }
+  munmap(diskMap, (size_t) diskSectors * 512);
+  close(diskFd);
+  diskMap = NULL;
+  diskFd = -1;
+  diskPrivate = false;
+}
+
+
 /* ---------------------------------------------------------- */
 
 /* WiFi network */
@@ -664,7 +1717,7 @@ void netInit(void) {
 
 static Bool debugSPI = false;
 
-static Word spiSelect;
+static PER_MACHINE Word spiSelect;
 
 
 /*
@@ -742,6 +1795,11 @@ void initSPI(char *diskName) {
 }
 
 
+void exitSPI(void) {
+  diskExit();
+}
+
+
 /**************************************************************/
 
 /*
@@ -862,12 +1920,24 @@ Word readShutdown(void) {
 }
 
 
+void exitRS232_1(void);
+
+
 /*
  * write device 15:
  *     exit simulator with lowest 8 bits of value as status
  */
 void writeShutdown(Word data) {
+  if (hosted != NULL) {
+    /* a hosted machine stops, the host goes on */
+    hostedShutdown(data & 0xFF);
+    return;
+  }
+  exitRS232_0();
+  exitRS232_1();
+  exitSPI();
   graphExit();
+  showHostTime();
   printf("RISC5 simulator shutdown\n");
   exit(data & 0xFF);
 }
@@ -982,53 +2052,69 @@ void writeIO(int dev, Word data) {
 
 #define HPT_SCALING		100
 
+/*
+ * approximate possibly non-integer CC_PER_INST by the
+ * integer ratio (CC_PER_INST * HPT_SCALING) / HPT_SCALING
+ */
+#define HPT_CC_SCALED		((Time) (CC_PER_INST * HPT_SCALING + 0.5))
 
-static Word HPTcounter_0;
-static Word HPTdivisor_0;
-static Word HPTstatus_0;
-static Word HPTcontrol_0;
 
+/*
+ * clock cycles counted by the first t instructions
+ */
+static Time HPTclock(Time t) {
+  return t * HPT_CC_SCALED / HPT_SCALING;
+}
 
-static void tickHPTcounter_0(int clockCycles) {
-  if (HPTcounter_0 <= clockCycles) {
-    HPTcounter_0 += HPTdivisor_0 - clockCycles;
-    HPTstatus_0 |= HPT_EXPIRED;
-    if (HPTcontrol_0 & HPT_IEN) {
-      cpuSetInterrupt(IRQ_HPT_0);
-    }
-  } else {
-    HPTcounter_0 -= clockCycles;
-  }
+
+/*
+ * instruction at which a counter, holding the given value
+ * at instruction t, reaches zero (i.e., the first one with
+ * HPTclock() - HPTclock(t) >= value)
+ */
+static Time HPTexpiry(Word value, Time t) {
+  Time due;
+
+  due = ((HPTclock(t) + value) * HPT_SCALING + HPT_CC_SCALED - 1) /
+        HPT_CC_SCALED;
+  return due > t ? due : t + 1;
 }
 
 
-void tickHPT_0(void) {
-  static int accumulator = 0;
-  int clockCycles;
+static PER_MACHINE Word HPTcounter_0;	/* counter value at HPTtime_0 */
+static PER_MACHINE Time HPTtime_0;
+static PER_MACHINE Word HPTdivisor_0;
+static PER_MACHINE Word HPTstatus_0;
+static PER_MACHINE Word HPTcontrol_0;
 
-  /*
-   * approximate possibly non-integer CC_PER_INST by the
-   * integer ratio (CC_PER_INST * HPT_SCALING) / HPT_SCALING
-   */
-  accumulator += (int) (CC_PER_INST * HPT_SCALING + 0.5);
-  clockCycles = 0;
-  while (accumulator >= HPT_SCALING) {
-    accumulator -= HPT_SCALING;
-    clockCycles++;
-  }
-  if (clockCycles > 0) {
-    tickHPTcounter_0(clockCycles);
+
+static Word HPTvalue_0(Time t) {
+  return HPTcounter_0 - (Word) (HPTclock(t) - HPTclock(HPTtime_0));
+}
+
+
+static void expireHPT_0(Event *ev) {
+  /* count on from where the counter crossed zero */
+  HPTcounter_0 = HPTvalue_0(simTime) + HPTdivisor_0;
+  HPTtime_0 = simTime;
+  eventSchedule(ev, HPTexpiry(HPTcounter_0, HPTtime_0));
+  HPTstatus_0 |= HPT_EXPIRED;
+  if (HPTcontrol_0 & HPT_IEN) {
+    cpuSetInterrupt(IRQ_HPT_0);
   }
 }
 
 
+static PER_MACHINE Event HPTevent_0 = { "HPT 0", expireHPT_0, 0, 0, -1 };
+
+
 /*
  * read extended device 0:
  *     HPT counter
  *     { data[31:0] }
  */
 Word readHPTdata_0(void) {
-  return HPTcounter_0;
+  return HPTvalue_0(simTime);
 }
 
 
@@ -1041,6 +2127,8 @@ void writeHPTdata_0(Word data) {
   HPTdivisor_0 = data;
   /* must also reset the counter */
   HPTcounter_0 = data;
+  HPTtime_0 = simTime;
+  eventSchedule(&HPTevent_0, HPTexpiry(HPTcounter_0, HPTtime_0));
 }
 
 
@@ -1084,8 +2172,10 @@ void writeHPTctrl_0(Word data) {
 void initHPT_0(void) {
   HPTdivisor_0 = 0xFFFFFFFF;
   HPTcounter_0 = 0xFFFFFFFF;
+  HPTtime_0 = simTime;
   HPTstatus_0 = 0;
   HPTcontrol_0 = 0;
+  eventSchedule(&HPTevent_0, HPTexpiry(HPTcounter_0, HPTtime_0));
 }
 
 
@@ -1105,19 +2195,19 @@ void initHPT_0(void) {
 static Bool debugLCDupdate = false;
 static Bool debugLCDcommand = false;
 
-static Byte lcd_line[128];
-static Byte lcd_addr_cnt;
-static Bool lcd_cgram_acc;
-static Bool lcd_display_on;
-static Bool lcd_cursor_on;
-static Bool lcd_blink_on;
-static Bool lcd_inc;
-static Bool lcd_shift;
-static Bool lcd_busy_flg;
+static PER_MACHINE Byte lcd_line[128];
+static PER_MACHINE Byte lcd_addr_cnt;
+static PER_MACHINE Bool lcd_cgram_acc;
+static PER_MACHINE Bool lcd_display_on;
+static PER_MACHINE Bool lcd_cursor_on;
+static PER_MACHINE Bool lcd_blink_on;
+static PER_MACHINE Bool lcd_inc;
+static PER_MACHINE Bool lcd_shift;
+static PER_MACHINE Bool lcd_busy_flg;
 
-static Word data_ibuf = 0;	/* data/instr to be written to LCD */
-static Word data_obuf = 0;	/* data/status read from LCD */
-static Word ctrl_ibuf = 0;	/* control lines to LCD */
+static PER_MACHINE Word data_ibuf = 0;	/* data/instr to be written to LCD */
+static PER_MACHINE Word data_obuf = 0;	/* data/status read from LCD */
+static PER_MACHINE Word ctrl_ibuf = 0;	/* control lines to LCD */
 
 
 void showLCD(void) {
@@ -1435,8 +2525,8 @@ void initLCD(void) {
 
 static Bool debugBTNSWT = false;
 
-static Word BTNSWTstatus;
-static Word BTNSWTcontrol;
+static PER_MACHINE Word BTNSWTstatus;
+static PER_MACHINE Word BTNSWTcontrol;
 
 
 void setBTNSWT(Word data) {
@@ -1521,52 +2611,40 @@ void initBTNSWT(Word initialBtnSwt) {
  */
 
 
-static Word HPTcounter_1;
-static Word HPTdivisor_1;
-static Word HPTstatus_1;
-static Word HPTcontrol_1;
+static PER_MACHINE Word HPTcounter_1;	/* counter value at HPTtime_1 */
+static PER_MACHINE Time HPTtime_1;
+static PER_MACHINE Word HPTdivisor_1;
+static PER_MACHINE Word HPTstatus_1;
+static PER_MACHINE Word HPTcontrol_1;
 
 
-static void tickHPTcounter_1(int clockCycles) {
-  if (HPTcounter_1 <= clockCycles) {
-    HPTcounter_1 += HPTdivisor_1 - clockCycles;
-    HPTstatus_1 |= HPT_EXPIRED;
-    if (HPTcontrol_1 & HPT_IEN) {
-      cpuSetInterrupt(IRQ_HPT_1);
-    }
-  } else {
-    HPTcounter_1 -= clockCycles;
-  }
+static Word HPTvalue_1(Time t) {
+  return HPTcounter_1 - (Word) (HPTclock(t) - HPTclock(HPTtime_1));
 }
 
 
-void tickHPT_1(void) {
-  static int accumulator = 0;
-  int clockCycles;
-
-  /*
-   * approximate possibly non-integer CC_PER_INST by the
-   * integer ratio (CC_PER_INST * HPT_SCALING) / HPT_SCALING
-   */
-  accumulator += (int) (CC_PER_INST * HPT_SCALING + 0.5);
-  clockCycles = 0;
-  while (accumulator >= HPT_SCALING) {
-    accumulator -= HPT_SCALING;
-    clockCycles++;
-  }
-  if (clockCycles > 0) {
-    tickHPTcounter_1(clockCycles);
+static void expireHPT_1(Event *ev) {
+  /* count on from where the counter crossed zero */
+  HPTcounter_1 = HPTvalue_1(simTime) + HPTdivisor_1;
+  HPTtime_1 = simTime;
+  eventSchedule(ev, HPTexpiry(HPTcounter_1, HPTtime_1));
+  HPTstatus_1 |= HPT_EXPIRED;
+  if (HPTcontrol_1 & HPT_IEN) {
+    cpuSetInterrupt(IRQ_HPT_1);
   }
 }
 
 
+static PER_MACHINE Event HPTevent_1 = { "HPT 1", expireHPT_1, 0, 0, -1 };
+
+
 /*
  * read extended device 6:
  *     HPT counter
  *     { data[31:0] }
  */
 Word readHPTdata_1(void) {
-  return HPTcounter_1;
+  return HPTvalue_1(simTime);
 }
 
 
@@ -1579,6 +2657,8 @@ void writeHPTdata_1(Word data) {
   HPTdivisor_1 = data;
   /* must also reset the counter */
   HPTcounter_1 = data;
+  HPTtime_1 = simTime;
+  eventSchedule(&HPTevent_1, HPTexpiry(HPTcounter_1, HPTtime_1));
 }
 
 
@@ -1622,8 +2702,10 @@ void writeHPTctrl_1(Word data) {
 void initHPT_1(void) {
   HPTdivisor_1 = 0xFFFFFFFF;
   HPTcounter_1 = 0xFFFFFFFF;
+  HPTtime_1 = simTime;
   HPTstatus_1 = 0;
   HPTcontrol_1 = 0;
+  eventSchedule(&HPTevent_1, HPTexpiry(HPTcounter_1, HPTtime_1));
 }
 
 
@@ -1634,56 +2716,75 @@ void initHPT_1(void) {
  */
 
 
-static FILE *serialIn_1;
-static FILE *serialOut_1;
-static Word serialRcvData_1;
-static Word serialXmtData_1;
-static Word serialStatus_1;
-static Word serialControl_1;
+static PER_MACHINE SerialHost serialHost_1;
+static PER_MACHINE Word serialRcvData_1;
+static PER_MACHINE Word serialXmtData_1;
+static PER_MACHINE Word serialStatus_1;
+static PER_MACHINE Word serialControl_1;
+static PER_MACHINE Word serialRate_1;	/* baud */
+
+
+static PER_MACHINE Event emptyEvent_1;
+
+
+static void fetchRS232_1(void) {
+  Byte c;
+
+  if (serialGet(&serialHost_1, &c)) {
+    serialRcvData_1 = c;
+    serialStatus_1 |= SERIAL_RCV_RDY;
+    if (serialControl_1 & SERIAL_RCV_RDY_IEN) {
+      cpuSetInterrupt(IRQ_RS232_1_RCV);
+    }
+  }
+}
+
 
+static void receiveRS232_1(Event *ev) {
+  /* the line is polled every serialPollTime() + 1 instructions */
+  eventSchedule(ev, simTime + serialPollTime(serialRate_1) + 1);
+  if (serialBaud == SERIAL_BAUD_INF &&
+      (serialStatus_1 & SERIAL_RCV_RDY) != 0) {
+    /* at full speed, the host waits for the program */
+    return;
+  }
+  fetchRS232_1();
+}
 
-void tickRS232_1(void) {
-  static int rcvCount = 0;
-  static int xmtCount = 0;
-  static int emptyCount = 0;
-  int c;
 
-  if (rcvCount++ == INST_PER_CHAR) {
-    rcvCount = 0;
-    c = fgetc(serialIn_1);
-    if (c != EOF) {
-      serialRcvData_1 = c & 0xFF;
-      serialStatus_1 |= SERIAL_RCV_RDY;
-      if (serialControl_1 & SERIAL_RCV_RDY_IEN) {
-        cpuSetInterrupt(IRQ_RS232_1_RCV);
-      }
-    }
+static void transmitRS232_1(Event *ev) {
+  if (!serialPut(&serialHost_1, serialXmtData_1 & 0xFF) &&
+      serialBaud == SERIAL_BAUD_INF) {
+    /* at full speed, the program waits for the host */
+    serialKick(&serialHost_1);
+    eventSchedule(ev, simTime + SERIAL_POLL_INF + 1);
+    return;
   }
-  if ((serialStatus_1 & SERIAL_XMT_RDY) == 0) {
-    if (xmtCount++ == INST_PER_CHAR) {
-      xmtCount = 0;
-      emptyCount = 0;
-      fputc(serialXmtData_1 & 0xFF, serialOut_1);
-      serialStatus_1 |= SERIAL_XMT_RDY;
-      if (serialControl_1 & SERIAL_XMT_RDY_IEN) {
-        cpuSetInterrupt(IRQ_RS232_1_XMT);
-      }
-    }
-  } else {
-    if ((serialStatus_1 & SERIAL_XMT_EMPTY) == 0) {
-      // one character delay until transmitter empty
-      if (emptyCount++ == INST_PER_CHAR) {
-        emptyCount = 0;
-        serialStatus_1 |= SERIAL_XMT_EMPTY;
-        if (serialControl_1 & SERIAL_XMT_EMPTY_IEN) {
-          cpuSetInterrupt(IRQ_RS232_1_XMT);
-        }
-      }
-    }
+  /* else lost if the host is far behind, as on a full line */
+  serialStatus_1 |= SERIAL_XMT_RDY;
+  if (serialControl_1 & SERIAL_XMT_RDY_IEN) {
+    cpuSetInterrupt(IRQ_RS232_1_XMT);
+  }
+  // one character delay until transmitter empty
+  eventSchedule(&emptyEvent_1, simTime + serialCharTime(serialRate_1) + 1);
+}
+
+
+static void emptyRS232_1(Event *ev) {
+  /* end of a burst: hand it over to the host */
+  serialKick(&serialHost_1);
+  serialStatus_1 |= SERIAL_XMT_EMPTY;
+  if (serialControl_1 & SERIAL_XMT_EMPTY_IEN) {
+    cpuSetInterrupt(IRQ_RS232_1_XMT);
   }
 }
 
 
+static PER_MACHINE Event rcvEvent_1 = { "RS232 1 receive", receiveRS232_1, 0, 0, -1 };
+static PER_MACHINE Event xmtEvent_1 = { "RS232 1 transmit", transmitRS232_1, 0, 0, -1 };
+static PER_MACHINE Event emptyEvent_1 = { "RS232 1 empty", emptyRS232_1, 0, 0, -1 };
+
+
 /*
  * read extended device 8:
  *     receiver data
@@ -1704,6 +2805,11 @@ Word readRS232data_1(void) {
  *     { 24'bx, xmt_data[7:0] }
  */
 void writeRS232data_1(Word data) {
+  if (serialStatus_1 & SERIAL_XMT_RDY) {
+    /* transmitter idle: start sending */
+    eventSchedule(&xmtEvent_1, simTime + serialCharTime(serialRate_1) + 1);
+  }
+  eventCancel(&emptyEvent_1);
   serialXmtData_1 = data & 0xFF;
   serialStatus_1 &= ~(SERIAL_XMT_RDY | SERIAL_XMT_EMPTY);
   if (serialControl_1 & (SERIAL_XMT_RDY_IEN | SERIAL_XMT_EMPTY_IEN)) {
@@ -1718,6 +2824,11 @@ void writeRS232data_1(Word data) {
  *     { 29'bx, xmt_empty, xmt_rdy, rcv_rdy }
  */
 Word readRS232ctrl_1(void) {
+  if (serialBaud == SERIAL_BAUD_INF &&
+      (serialStatus_1 & SERIAL_RCV_RDY) == 0) {
+    /* at full speed, do not wait for the next poll */
+    fetchRS232_1();
+  }
   return serialStatus_1;
 }
 
@@ -1768,7 +2879,11 @@ void writeRS232ctrl_1(Word data) {
   } else {
     cpuResetInterrupt(IRQ_RS232_1_XMT);
   }
-  /* ignore setting the baud rate in simulation */
+  /* set the baud rate, takes effect with the next character */
+  if (data & SERIAL_SET_BAUD) {
+    serialRate_1 =
+      serialBaudTable[(data >> SERIAL_BAUD_SHIFT) & SERIAL_BAUD_MASK];
+  }
 }
 
 
@@ -1776,9 +2891,8 @@ void initRS232_1(void) {
   int master;
   char slavePath[100];
   FILE *serdevFile;
+  char buf[64];
 
-  serialIn_1 = NULL;
-  serialOut_1 = NULL;
   master = open("/dev/ptmx", O_RDWR | O_NONBLOCK);
   if (master < 0) {
     error("cannot open pseudo terminal master for serial line");
@@ -1796,13 +2910,210 @@ void initRS232_1(void) {
   fclose(serdevFile);
   printf("This path was also written to file '%s'.\n", SERDEV_FILE);
   fcntl(master, F_SETFL, O_NONBLOCK);
-  serialIn_1 = fdopen(master, "r");
-  setvbuf(serialIn_1, NULL, _IONBF, 0);
-  serialOut_1 = fdopen(master, "w");
-  setvbuf(serialOut_1, NULL, _IONBF, 0);
-  while (fgetc(serialIn_1) != EOF) ;
+  while (read(master, buf, sizeof(buf)) > 0) ;
+  serialHost_1.rcv.head = serialHost_1.rcv.tail = 0;
+  serialHost_1.xmt.head = serialHost_1.xmt.tail = 0;
+  serialStart(&serialHost_1, master);
   serialStatus_1 = SERIAL_XMT_RDY | SERIAL_XMT_EMPTY;
   serialControl_1 = 0;
+  serialRate_1 = serialBaud != SERIAL_BAUD_INF ? serialBaud : BAUD_RATE;
+  eventSchedule(&rcvEvent_1, simTime + serialPollTime(serialRate_1) + 1);
+}
+
+
+void exitRS232_1(void) {
+  serialStop(&serialHost_1);
+}
+
+
+/*
+ * keep line 1 going after fork() (used by batch mode children)
+ */
+void reviveRS232_1(void) {
+  serialRevive(&serialHost_1);
+}
+
+
+/**************************************************************/
+
+/*
+ * Extended I/O devices 10..14: paravirtual block device
+ *
+ * This device exists only in the simulator. It copies whole
+ * 512-byte blocks between the SD card image and main memory,
+ * so that a driver need not shift every byte through the SPI
+ * interface. The buffer must lie entirely in RAM below the
+ * frame buffer, else the request fails. Blocks are numbered
+ * as the SPI commands of an SDHC card number them. A transfer
+ * is done as soon as it is started; a completion interrupt is
+ * raised if enabled.
+ */
+
+
+#define PVD_IDENT	0x44425650		/* 'PVBD' */
+
+#define PVD_OP_MASK	0x00000003
+#define PVD_OP_NONE	0
+#define PVD_OP_READ	1
+#define PVD_OP_WRITE	2
+#define PVD_DONE	0x00000001
+#define PVD_ERROR	0x00000002
+#define PVD_IRQ_EN	0x00000100
+
+
+static Bool debugPVD = false;
+
+static PER_MACHINE Word PVDsector;	/* first block to transfer */
+static PER_MACHINE Word PVDaddr;	/* byte address of the buffer */
+static PER_MACHINE Word PVDcount;	/* number of blocks */
+static PER_MACHINE Word PVDstatus;
+
+
+Word readWord(Word addr);
+void writeWord(Word addr, Word data);
+
+
+/*
+ * check the request and copy the blocks,
+ * return false if the request is invalid
+ */
+static Bool PVDtransfer(int op) {
+  Word secnum;
+  Word addr;
+  Word n;
+  Byte *p;
+  int i;
+
+  if (diskMap == NULL ||
+      (PVDaddr & 3) != 0 ||
+      PVDsector < diskOffset ||
+      PVDcount > diskSectors ||
+      PVDsector - diskOffset > diskSectors - PVDcount ||
+      PVDaddr < RAM_BASE ||
+      PVDaddr >= GRAPH_BASE ||
+      PVDcount > (GRAPH_BASE - PVDaddr) / 512) {
+    return false;
+  }
+  secnum = PVDsector - diskOffset;
+  addr = PVDaddr;
+  for (n = 0; n < PVDcount; n++) {
+    if (op == PVD_OP_READ) {
+      p = diskSectorData(secnum);
+      for (i = 0; i < 128; i++) {
+        writeWord(addr, diskGetWord(p));
+        p += 4;
+        addr += 4;
+      }
+    } else {
+      p = diskSectorDest(secnum);
+      for (i = 0; i < 128; i++) {
+        diskPutWord(p, readWord(addr));
+        p += 4;
+        addr += 4;
+      }
+      diskSectorWritten(secnum);
+    }
+    secnum++;
+  }
+  return true;
+}
+
+
+/*
+ * read extended devices 10, 11, 12:
+ *     return block number, buffer address, block count
+ */
+Word readPVDsector(void) {
+  return PVDsector;
+}
+
+
+Word readPVDaddr(void) {
+  return PVDaddr;
+}
+
+
+Word readPVDcount(void) {
+  return PVDcount;
+}
+
+
+/*
+ * write extended devices 10, 11, 12:
+ *     set block number, buffer address, block count
+ */
+void writePVDsector(Word data) {
+  PVDsector = data;
+}
+
+
+void writePVDaddr(Word data) {
+  PVDaddr = data & ADDR_MASK;
+}
+
+
+void writePVDcount(Word data) {
+  PVDcount = data;
+}
+
+
+/*
+ * read extended device 13:
+ *     return status
+ *     { 23'bx, irq_en, 6'bx, error, done }
+ */
+Word readPVDctrl(void) {
+  return PVDstatus;
+}
+
+
+/*
+ * write extended device 13:
+ *     acknowledge the last transfer, start a new one
+ *     { 23'bx, irq_en, 6'bx, op[1:0] }
+ *     op: 0 = none, 1 = read blocks, 2 = write blocks
+ */
+void writePVDctrl(Word data) {
+  int op;
+
+  op = data & PVD_OP_MASK;
+  if (debugPVD) {
+    printf("PVD: op %d, block 0x%08X, addr 0x%08X, count %u\n",
+           op, PVDsector, PVDaddr, PVDcount);
+  }
+  PVDstatus = data & PVD_IRQ_EN;
+  cpuResetInterrupt(IRQ_PVD);
+  if (op == PVD_OP_NONE) {
+    return;
+  }
+  if (op != PVD_OP_READ && op != PVD_OP_WRITE) {
+    PVDstatus |= PVD_ERROR;
+  } else
+  if (!PVDtransfer(op)) {
+    PVDstatus |= PVD_ERROR;
+  }
+  PVDstatus |= PVD_DONE;
+  if (PVDstatus & PVD_IRQ_EN) {
+    cpuSetInterrupt(IRQ_PVD);
+  }
+}
+
+
+/*
+ * read extended device 14:
+ *     return the device identification,
+ *     or 0 if there is no disk image
+ */
+Word readPVDident(void) {
+  return diskMap != NULL ? PVD_IDENT : 0;
+}
+
+
+void initPVD(void) {
+  PVDsector = 0;
+  PVDaddr = 0;
+  PVDcount = 0;
+  PVDstatus = 0;
 }
 
 
@@ -1845,6 +3156,21 @@ Word readXIO(int dev) {
     case 9:
       data = readRS232ctrl_1();
       break;
+    case 10:
+      data = readPVDsector();
+      break;
+    case 11:
+      data = readPVDaddr();
+      break;
+    case 12:
+      data = readPVDcount();
+      break;
+    case 13:
+      data = readPVDctrl();
+      break;
+    case 14:
+      data = readPVDident();
+      break;
     default:
       error("reading from unknown extended I/O device %d", dev);
       data = 0;
@@ -1883,6 +3209,18 @@ void writeXIO(int dev, Word data) {
     case 9:
       writeRS232ctrl_1(data);
       break;
+    case 10:
+      writePVDsector(data);
+      break;
+    case 11:
+      writePVDaddr(data);
+      break;
+    case 12:
+      writePVDcount(data);
+      break;
+    case 13:
+      writePVDctrl(data);
+      break;
     default:
       error("writing to unknown extended I/O device %d, data = 0x%08X",
             dev, data);
@@ -1894,38 +3232,249 @@ void writeXIO(int dev, Word data) {
 /**************************************************************/
 
 /*
- * main memory
+ * device event timing check
+ *
+ * If checkEvents is set, the devices are visited before every
+ * instruction: the original per-instruction device counters
+ * are run alongside the event scheduler, and the simulation
+ * stops as soon as the two disagree about an interrupt source.
  */
 
 
-static Word ram[RAM_SIZE >> 2];
-static Word rom[ROM_SIZE >> 2];
+static PER_MACHINE Time rcvCount[2] = { 0, 0 };
+static PER_MACHINE Time xmtCount[2] = { 0, 0 };
+static PER_MACHINE Time emptyCount[2] = { 0, 0 };
+static PER_MACHINE Time rcvPeriod[2];
+static PER_MACHINE Time xmtPeriod[2];
+static PER_MACHINE Time emptyPeriod[2];
 
 
-Word cpuGetPC(void);
+/*
+ * the rate in effect when a count starts
+ * holds until the count is complete
+ */
+static void tickSerial(int line, Word status, Word rate, Bool expect[3]) {
+  if (rcvCount[line] == 0) {
+    rcvPeriod[line] = serialPollTime(rate);
+  }
+  expect[0] = (rcvCount[line]++ == rcvPeriod[line]);
+  if (expect[0]) {
+    rcvCount[line] = 0;
+  }
+  expect[1] = false;
+  expect[2] = false;
+  if ((status & SERIAL_XMT_RDY) == 0) {
+    if (xmtCount[line] == 0) {
+      xmtPeriod[line] = serialCharTime(rate);
+    }
+    if (xmtCount[line]++ == xmtPeriod[line]) {
+      xmtCount[line] = 0;
+      emptyCount[line] = 0;
+      expect[1] = true;
+    }
+  } else {
+    if ((status & SERIAL_XMT_EMPTY) == 0) {
+      if (emptyCount[line] == 0) {
+        emptyPeriod[line] = serialCharTime(rate);
+      }
+      if (emptyCount[line]++ == emptyPeriod[line]) {
+        emptyCount[line] = 0;
+        expect[2] = true;
+      }
+    }
+  }
+}
 
 
-Word readWord(Word addr) {
-  addr &= ADDR_MASK;
-  if ((addr & 3) != 0) {
-    error("memory read word @ 0x%08X not word aligned, PC = 0x%08X",
-          addr, cpuGetPC() - 4);
+static Word tickCounter(Word counter, Word divisor,
+                        int clockCycles, Bool *expired) {
+  *expired = false;
+  if (clockCycles == 0) {
+    return counter;
   }
-  if (addr >= RAM_BASE && addr < RAM_BASE + RAM_SIZE) {
-    if (addr >= GRAPH_BASE && addr < GRAPH_BASE + GRAPH_SIZE) {
-      return graphRead((addr - GRAPH_BASE) >> 2);
-    } else {
-      return ram[(addr - RAM_BASE) >> 2];
-    }
+  if (counter <= clockCycles) {
+    *expired = true;
+    return counter + divisor - clockCycles;
+  }
+  return counter - clockCycles;
+}
+
+
+static void checkEvent(Event *ev, Bool expected) {
+  if ((ev->fired == simTime) != expected) {
+    error("event '%s' %s at instruction %llu",
+          ev->name, expected ? "missing" : "unexpected", simTime);
+  }
+}
+
+
+static void checkCounter(char *name, Word actual, Word expected) {
+  if (actual != expected) {
+    error("%s counter is 0x%08X instead of 0x%08X at instruction %llu",
+          name, actual, expected, simTime);
+  }
+}
+
+
+static void checkDevices(void) {
+  static PER_MACHINE int timerCount = 0;
+  static PER_MACHINE int accumulator = 0;
+  Bool timer;
+  Bool serial_0[3];
+  Bool serial_1[3];
+  int clockCycles;
+  Word counter_0, counter_1;
+  Bool expired_0, expired_1;
+
+  /* what the per-instruction counters predict */
+  timer = (++timerCount == INST_PER_MSEC);
+  if (timer) {
+    timerCount = 0;
   }
-  if (addr >= ROM_BASE && addr < ROM_BASE + ROM_SIZE) {
-    return rom[(addr - ROM_BASE) >> 2];
+  tickSerial(0, serialStatus_0, serialRate_0, serial_0);
+  tickSerial(1, serialStatus_1, serialRate_1, serial_1);
+  accumulator += HPT_CC_SCALED;
+  clockCycles = 0;
+  while (accumulator >= HPT_SCALING) {
+    accumulator -= HPT_SCALING;
+    clockCycles++;
+  }
+  counter_0 = tickCounter(HPTvalue_0(simTime - 1), HPTdivisor_0,
+                          clockCycles, &expired_0);
+  counter_1 = tickCounter(HPTvalue_1(simTime - 1), HPTdivisor_1,
+                          clockCycles, &expired_1);
+  /* what the scheduler does */
+  runEvents();
+  checkEvent(&timerEvent, timer);
+  checkEvent(&rcvEvent_0, serial_0[0]);
+  checkEvent(&xmtEvent_0, serial_0[1]);
+  checkEvent(&emptyEvent_0, serial_0[2]);
+  checkEvent(&rcvEvent_1, serial_1[0]);
+  checkEvent(&xmtEvent_1, serial_1[1]);
+  checkEvent(&emptyEvent_1, serial_1[2]);
+  checkEvent(&HPTevent_0, expired_0);
+  checkEvent(&HPTevent_1, expired_1);
+  checkCounter("HPT 0", HPTvalue_0(simTime), counter_0);
+  checkCounter("HPT 1", HPTvalue_1(simTime), counter_1);
+  eventUpdate();
+}
+
+
+/**************************************************************/
+
+/*
+ * main memory
+ */
+
+
+static PER_MACHINE Word *ram;	/* allocated, or mapped from a snapshot */
+static PER_MACHINE Bool ramMapped = false;
+static PER_MACHINE Word rom[ROM_SIZE >> 2];
+
+
+/*
+ * predecoded instruction cache
+ *     one entry for each word of RAM and PROM, filled when the
+ *     word is first executed, invalidated when the word is written
+ */
+
+
+typedef struct decoded {
+  union {
+    void (*exec)(struct decoded *dp);	/* handler function */
+    const void *label;			/* handler code, threaded engine */
+  } h;				/* NULL if not decoded */
+  Word imm;			/* immediate value, offset, or instr */
+  Byte a, b, c;			/* register numbers */
+  Byte op;			/* handler-specific operation code */
+} Decoded;
+
+
+static Bool decodeCache = true;	/* use predecoded instructions if true */
+
+static PER_MACHINE Decoded *ramDecoded;	/* allocated with the RAM */
+static PER_MACHINE Decoded romDecoded[ROM_SIZE >> 2];
+
+
+Word cpuGetPC(void);
+
+
+/*
+ * memory page table
+ *     plain RAM pages map straight to host memory (PROM pages
+ *     only for reading), all other pages are handled by word
+ *     read and write functions; host byte and half-word
+ *     accesses are only used on little-endian hosts; the
+ *     pages of RAM and PROM also point to their predecoded
+ *     instructions, so that a fetch needs a single lookup
+ */
+
+
+#define MEM_PAGE_SHIFT	12
+#define MEM_PAGE_SIZE	(1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK	(MEM_PAGE_SIZE - 1)
+#define NUM_MEM_PAGES	((ADDR_MASK + 1) >> MEM_PAGE_SHIFT)
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_SUBWORD
+typedef Half HostHalf __attribute__((__may_alias__));
+#endif
+
+
+typedef struct {
+  Byte *rdHost;				/* host memory to read from */
+  Byte *wrHost;				/* host memory to write to */
+  Word (*read)(Word addr);		/* used if rdHost is NULL */
+  void (*write)(Word addr, Word data);	/* used if wrHost is NULL */
+  Decoded *decoded;			/* NULL if not executable */
+} Page;
+
+
+static PER_MACHINE Page pageTable[NUM_MEM_PAGES];
+
+
+static Decoded *lookupDecoded(Word addr) {
+  Decoded *dp;
+
+  dp = pageTable[addr >> MEM_PAGE_SHIFT].decoded;
+  if (dp == NULL || (addr & 3) != 0) {
+    return NULL;
   }
+  return dp + ((addr & MEM_PAGE_MASK) >> 2);
+}
+
+
+static Word readGraphPage(Word addr) {
+  return graphRead((addr - GRAPH_BASE) >> 2);
+}
+
+
+static void writeGraphPage(Word addr, Word data) {
+  idleQuiet = false;
+  graphWrite((addr - GRAPH_BASE) >> 2, data);
+}
+
+
+static void writeROMPage(Word addr, Word data) {
+  error("PROM write word @ 0x%08X, PC = 0x%08X",
+        addr, cpuGetPC() - 4);
+}
+
+
+static Word readIOPage(Word addr) {
+  int dev;
+  Word data;
+
   if (addr >= XIO_BASE && addr < XIO_BASE + XIO_SIZE) {
+    idleQuiet = false;
     return readXIO((addr - XIO_BASE) >> 2);
   }
   if (addr >= IO_BASE && addr < IO_BASE + IO_SIZE) {
-    return readIO((addr - IO_BASE) >> 2);
+    dev = (addr - IO_BASE) >> 2;
+    data = readIO(dev);
+    cpuIdleRead(dev, data);
+    return data;
   }
   error("memory read word @ 0x%08X off bounds, PC = 0x%08X",
         addr, cpuGetPC() - 4);
@@ -1934,45 +3483,151 @@ Word readWord(Word addr) {
 }
 
 
+static void writeIOPage(Word addr, Word data) {
+  idleQuiet = false;
+  if (addr >= XIO_BASE && addr < XIO_BASE + XIO_SIZE) {
+    writeXIO((addr - XIO_BASE) >> 2, data);
+    return;
+  }
+  if (addr >= IO_BASE && addr < IO_BASE + IO_SIZE) {
+    writeIO((addr - IO_BASE) >> 2, data);
+    return;
+  }
+  error("memory write word @ 0x%08X off bounds, PC = 0x%08X",
+        addr, cpuGetPC() - 4);
+}
+
+
+void memInit(void) {
+  Word addr;
+  Page *pp;
+
+  if (ram == NULL) {
+    ram = calloc(RAM_SIZE >> 2, sizeof(Word));
+    if (ram == NULL) {
+      error("cannot allocate RAM");
+    }
+  }
+  if (ramDecoded == NULL) {
+    ramDecoded = calloc(RAM_SIZE >> 2, sizeof(Decoded));
+    if (ramDecoded == NULL) {
+      error("cannot allocate decoded instruction cache");
+    }
+  }
+  for (addr = 0; addr <= ADDR_MASK; addr += MEM_PAGE_SIZE) {
+    pp = &pageTable[addr >> MEM_PAGE_SHIFT];
+    if (addr >= GRAPH_BASE && addr < GRAPH_BASE + GRAPH_SIZE) {
+      pp->rdHost = NULL;
+      pp->wrHost = NULL;
+      pp->read = readGraphPage;
+      pp->write = writeGraphPage;
+      pp->decoded = NULL;
+    } else
+    if (addr >= RAM_BASE && addr < RAM_BASE + RAM_SIZE) {
+      pp->rdHost = (Byte *) ram + (addr - RAM_BASE);
+      pp->wrHost = pp->rdHost;
+      pp->read = NULL;
+      pp->write = NULL;
+      pp->decoded = ramDecoded + ((addr - RAM_BASE) >> 2);
+    } else
+    if (addr >= ROM_BASE && addr < ROM_BASE + ROM_SIZE) {
+      pp->rdHost = (Byte *) rom + (addr - ROM_BASE);
+      pp->wrHost = NULL;
+      pp->read = NULL;
+      pp->write = writeROMPage;
+      pp->decoded = romDecoded + ((addr - ROM_BASE) >> 2);
+    } else {
+      pp->rdHost = NULL;
+      pp->wrHost = NULL;
+      pp->read = readIOPage;
+      pp->write = writeIOPage;
+      pp->decoded = NULL;
+    }
+  }
+}
+
+
+void memExit(void) {
+  if (ramMapped) {
+    munmap(ram, RAM_SIZE);
+  } else {
+    free(ram);
+  }
+  ram = NULL;
+  ramMapped = false;
+  free(ramDecoded);
+  ramDecoded = NULL;
+  /* the next PROM may be a different one */
+  memset(romDecoded, 0, sizeof(romDecoded));
+}
+
+
+/*
+ * bookkeeping for a host write to RAM which changed
+ * its contents (rewriting the same value needs none)
+ */
+static void ramWritten(Word addr) {
+  idleQuiet = false;
+  ramDecoded[(addr - RAM_BASE) >> 2].h.exec = NULL;
+}
+
+
+Word readWord(Word addr) {
+  Page *pp;
+
+  addr &= ADDR_MASK;
+  if ((addr & 3) != 0) {
+    error("memory read word @ 0x%08X not word aligned, PC = 0x%08X",
+          addr, cpuGetPC() - 4);
+  }
+  pp = &pageTable[addr >> MEM_PAGE_SHIFT];
+  if (pp->rdHost != NULL) {
+    return *(Word *) (pp->rdHost + (addr & MEM_PAGE_MASK));
+  }
+  return (*pp->read)(addr);
+}
+
+
 void writeWord(Word addr, Word data) {
+  Page *pp;
+  Word *p;
+
   addr &= ADDR_MASK;
   if ((addr & 3) != 0) {
     error("memory write word @ 0x%08X not word aligned, PC = 0x%08X",
           addr, cpuGetPC() - 4);
   }
-  if (addr >= RAM_BASE && addr < RAM_BASE + RAM_SIZE) {
-    if (addr >= GRAPH_BASE && addr < GRAPH_BASE + GRAPH_SIZE) {
-      graphWrite((addr - GRAPH_BASE) >> 2, data);
-    } else {
-      ram[(addr - RAM_BASE) >> 2] = data;
+  pp = &pageTable[addr >> MEM_PAGE_SHIFT];
+  if (pp->wrHost != NULL) {
+    p = (Word *) (pp->wrHost + (addr & MEM_PAGE_MASK));
+    if (*p != data) {
+      *p = data;
+      ramWritten(addr);
     }
     return;
   }
-  if (addr >= ROM_BASE && addr < ROM_BASE + ROM_SIZE) {
-    error("PROM write word @ 0x%08X, PC = 0x%08X",
-          addr, cpuGetPC() - 4);
-  }
-  if (addr >= XIO_BASE && addr < XIO_BASE + XIO_SIZE) {
-    writeXIO((addr - XIO_BASE) >> 2, data);
-    return;
-  }
-  if (addr >= IO_BASE && addr < IO_BASE + IO_SIZE) {
-    writeIO((addr - IO_BASE) >> 2, data);
-    return;
-  }
-  error("memory write word @ 0x%08X off bounds, PC = 0x%08X",
-        addr, cpuGetPC() - 4);
+  (*pp->write)(addr, data);
 }
 
 
 Half readHalf(Word addr) {
   Word w;
   Half h;
+#ifdef HOST_SUBWORD
+  Page *pp;
+#endif
 
   if ((addr & 1) != 0) {
     error("memory read half @ 0x%08X not half-word aligned, PC = 0x%08X",
           addr, cpuGetPC() - 4);
   }
+#ifdef HOST_SUBWORD
+  addr &= ADDR_MASK;
+  pp = &pageTable[addr >> MEM_PAGE_SHIFT];
+  if (pp->rdHost != NULL) {
+    return *(HostHalf *) (pp->rdHost + (addr & MEM_PAGE_MASK));
+  }
+#endif
   w = readWord(addr & ~3);
   switch (addr & 2) {
     case 0:
@@ -1988,11 +3643,28 @@ Half readHalf(Word addr) {
 
 void writeHalf(Word addr, Half data) {
   Word w;
+#ifdef HOST_SUBWORD
+  Page *pp;
+  HostHalf *p;
+#endif
 
   if ((addr & 1) != 0) {
     error("memory write half @ 0x%08X not half-word aligned, PC = 0x%08X",
           addr, cpuGetPC() - 4);
   }
+#ifdef HOST_SUBWORD
+  addr &= ADDR_MASK;
+  pp = &pageTable[addr >> MEM_PAGE_SHIFT];
+  if (pp->wrHost != NULL) {
+    p = (HostHalf *) (pp->wrHost + (addr & MEM_PAGE_MASK));
+    if (*p != data) {
+      *p = data;
+      ramWritten(addr & ~3);
+    }
+    return;
+  }
+#endif
+  /* devices and PROM see a word read-modify-write */
   w = readWord(addr & ~3);
   switch (addr & 2) {
     case 0:
@@ -2011,7 +3683,15 @@ void writeHalf(Word addr, Half data) {
 Byte readByte(Word addr) {
   Word w;
   Byte b;
+#ifdef HOST_SUBWORD
+  Page *pp;
 
+  addr &= ADDR_MASK;
+  pp = &pageTable[addr >> MEM_PAGE_SHIFT];
+  if (pp->rdHost != NULL) {
+    return pp->rdHost[addr & MEM_PAGE_MASK];
+  }
+#endif
   w = readWord(addr & ~3);
   switch (addr & 3) {
     case 0:
@@ -2033,7 +3713,22 @@ Byte readByte(Word addr) {
 
 void writeByte(Word addr, Byte data) {
   Word w;
+#ifdef HOST_SUBWORD
+  Page *pp;
+  Byte *p;
 
+  addr &= ADDR_MASK;
+  pp = &pageTable[addr >> MEM_PAGE_SHIFT];
+  if (pp->wrHost != NULL) {
+    p = pp->wrHost + (addr & MEM_PAGE_MASK);
+    if (*p != data) {
+      *p = data;
+      ramWritten(addr & ~3);
+    }
+    return;
+  }
+#endif
+  /* devices and PROM see a word read-modify-write */
   w = readWord(addr & ~3);
   switch (addr & 3) {
     case 0:
@@ -2174,25 +3869,188 @@ void ramInit(char *ramName) {
 
 static Bool debugIRQ = false;	/* set to true if debugging IRQs */
 
-static Word pc;			/* program counter, as byte index */
-static Word reg[16];		/* general purpose registers */
-static Word ID;			/* special register for CPU identification */
-static Word H;			/* special register for mul/div */
-static Word X;			/* interrupt program counter */
-static Bool N, Z, C, V;		/* arithmetic flags */
-static Bool I, P;		/* interrupt flags */
-static unsigned irqAck;		/* interrupt last acknowledged */
-static unsigned irqMask;	/* one bit for each IRQ */
-static unsigned irqPending = 0;	/* one bit for each pending IRQ */
+static PER_MACHINE Word pc;			/* program counter, as byte index */
+static PER_MACHINE Word reg[16];		/* general purpose registers */
+static PER_MACHINE Word ID;			/* special register for CPU identification */
+static PER_MACHINE Word H;			/* special register for mul/div */
+static PER_MACHINE Word X;			/* interrupt program counter */
+static PER_MACHINE Bool I, P;			/* interrupt flags */
+static PER_MACHINE unsigned irqAck;		/* interrupt last acknowledged */
+static PER_MACHINE unsigned irqMask;		/* one bit for each IRQ */
+static PER_MACHINE unsigned irqPending = 0;	/* one bit for each pending IRQ */
 
-static Bool breakSet;		/* breakpoint set if true */
-static Word breakAddr;		/* if breakSet, this is where */
+static PER_MACHINE Bool breakSet;		/* breakpoint set if true */
+static PER_MACHINE Word breakAddr;		/* if breakSet, this is where */
 
-static Bool run;		/* CPU runs continuously if true */
+static PER_MACHINE Bool run;			/* CPU runs continuously if true */
 
+/*
+ * run may be cleared by another thread (machineHalt(),
+ * a signal handler), so it is only accessed atomically
+ */
+#define RUNNING()	__atomic_load_n(&run, __ATOMIC_RELAXED)
+#define SET_RUN(b)	__atomic_store_n(&run, (b), __ATOMIC_RELAXED)
 
-static void execNextInstruction(void) {
-  Word ir;
+
+/*
+ * arithmetic flags
+ *     evaluated lazily: flag-setting instructions only record
+ *     their result (ADD and SUB also their operands), and the
+ *     flags are computed from that when they are needed
+ */
+
+
+#define CV_FIXED	0	/* C and V held in fixedC, fixedV */
+#define CV_ADD		1	/* C and V from cvRes = cvB + cvD */
+#define CV_SUB		2	/* C and V from cvRes = cvB - cvD */
+
+static PER_MACHINE long long nzRes;		/* sign-extended result: N if < 0, */
+						/* Z if the lower 32 bits are 0 */
+static PER_MACHINE int cvOp;			/* how to compute C and V */
+static PER_MACHINE Word cvRes, cvB, cvD;	/* result and operands of ADD/SUB */
+static PER_MACHINE Bool fixedC, fixedV;		/* C and V if cvOp == CV_FIXED */
+
+/*
+ * the check of the lazy flags against eager ones is only
+ * compiled in with CHECK_FLAGS ('make CHECKFLAGS=1'), so
+ * that it costs nothing on the hot path of a normal build
+ */
+static PER_MACHINE Bool eagerN, eagerZ, eagerC, eagerV;
+
+
+#ifdef CHECK_FLAGS
+
+static Bool checkFlags = false;	/* maintain eager flags and compare */
+
+
+static void eagerSetNZ(Word res) {
+  eagerN = (res >> 31) & 1;
+  eagerZ = res == 0;
+}
+
+
+static void eagerSetCV(int op, Word res, Word b, Word d) {
+  if (op == CV_ADD) {
+    eagerC = res < b;
+    eagerV = ((res ^ d) & (res ^ b)) >> 31;
+  } else {
+    eagerC = res > b;
+    eagerV = ((b ^ d) & (res ^ b)) >> 31;
+  }
+}
+
+
+#define SET_NZ(res) \
+  do { \
+    nzRes = (int) (res); \
+    if (checkFlags) { \
+      eagerSetNZ(res); \
+    } \
+  } while (0)
+
+#define SET_CV(op, res, b, d) \
+  do { \
+    cvOp = (op); \
+    cvRes = (res); \
+    cvB = (b); \
+    cvD = (d); \
+    if (checkFlags) { \
+      eagerSetCV(op, res, b, d); \
+    } \
+  } while (0)
+
+#else
+
+#define SET_NZ(res) \
+  do { \
+    nzRes = (int) (res); \
+  } while (0)
+
+#define SET_CV(op, res, b, d) \
+  do { \
+    cvOp = (op); \
+    cvRes = (res); \
+    cvB = (b); \
+    cvD = (d); \
+  } while (0)
+
+#endif
+
+
+static Bool getC(void) {
+  switch (cvOp) {
+    case CV_ADD:
+      return cvRes < cvB;
+    case CV_SUB:
+      return cvRes > cvB;
+  }
+  return fixedC;
+}
+
+
+static Bool getV(void) {
+  switch (cvOp) {
+    case CV_ADD:
+      return ((cvRes ^ cvD) & (cvRes ^ cvB)) >> 31;
+    case CV_SUB:
+      return ((cvB ^ cvD) & (cvRes ^ cvB)) >> 31;
+  }
+  return fixedV;
+}
+
+
+#define N	(nzRes < 0)
+#define Z	((Word) nzRes == 0)
+#define C	getC()
+#define V	getV()
+
+
+static void setFlags(Bool n, Bool z, Bool c, Bool v) {
+  nzRes = (n ? -((long long) 1 << 32) : 0) | !z;
+  cvOp = CV_FIXED;
+  fixedC = c;
+  fixedV = v;
+  eagerN = n;
+  eagerZ = z;
+  eagerC = c;
+  eagerV = v;
+}
+
+
+#ifdef CHECK_FLAGS
+static void checkFlagState(void) {
+  if (N != eagerN || Z != eagerZ || C != eagerC || V != eagerV) {
+    error("lazy flags NZCV = %d%d%d%d, eager flags = %d%d%d%d, "
+          "PC = 0x%08X", N, Z, C, V,
+          eagerN, eagerZ, eagerC, eagerV, pc);
+  }
+}
+#endif
+
+
+/*
+ * called whenever simTime reaches nextEvent, which happens
+ * on every instruction if one of the checks is enabled
+ */
+static void tickDevices(void) {
+#ifdef CHECK_FLAGS
+  if (checkFlags) {
+    checkFlagState();
+  }
+#endif
+  if (checkEvents) {
+    checkDevices();
+  } else {
+    runEvents();
+  }
+}
+
+
+/*
+ * execute an instruction which has already been fetched
+ * (the PC has already been advanced to the next instruction)
+ */
+static void execInstruction(Word ir) {
   int p, q, u, v;
   int ira, irb, op, irc;
   int imm;
@@ -2203,9 +4061,6 @@ static void execNextInstruction(void) {
   Word aux;
   Bool writeback;
 
-  ir = readWord(pc);
-  pc += 4;
-  pc &= ADDR_MASK;
   p = (ir >> 31) & 0x01;
   q = (ir >> 30) & 0x01;
   u = (ir >> 29) & 0x01;
@@ -2251,10 +4106,8 @@ static void execNextInstruction(void) {
                   break;
                 case 3:
                   /* PSW */
-                  N = (res >> 31) & 1;
-                  Z = (res >> 30) & 1;
-                  C = (res >> 29) & 1;
-                  V = (res >> 28) & 1;
+                  setFlags((res >> 31) & 1, (res >> 30) & 1,
+                           (res >> 29) & 1, (res >> 28) & 1);
                   I = (res >> 27) & 1;
                   P = (res >> 26) & 1;
                   irqAck = (res >> 16) & 0x0000001F;
@@ -2345,14 +4198,12 @@ static void execNextInstruction(void) {
       case 0x08:
         /* ADD */
         res = b + d + (u & C);
-        C = res < b;
-        V = ((res ^ d) & (res ^ b)) >> 31;
+        SET_CV(CV_ADD, res, b, d);
         break;
       case 0x09:
         /* SUB */
         res = b - d - (u & C);
-        C = res > b;
-        V = ((b ^ d) & (res ^ b)) >> 31;
+        SET_CV(CV_SUB, res, b, d);
         break;
       case 0x0A:
         /* MUL */
@@ -2397,8 +4248,7 @@ static void execNextInstruction(void) {
     }
     if (writeback) {
       reg[ira] = res;
-      N = (res >> 31) & 1;
-      Z = res == 0;
+      SET_NZ(res);
     }
   } else {
     if (q == 0) {
@@ -2419,8 +4269,7 @@ static void execNextInstruction(void) {
           res = readByte(b + SIGN_EXT_20(ir & 0x000FFFFF));
         }
         reg[ira] = res;
-        N = (res >> 31) & 1;
-        Z = res == 0;
+        SET_NZ(res);
       } else {
         /* store */
         if (v == 0) {
@@ -2495,33 +4344,478 @@ static void execNextInstruction(void) {
               break;
           }
         } else {
-          /* call */
-          if (cond) {
-            aux = pc;
-            pc = c & ADDR_MASK;
-            reg[15] = aux;
-          }
+          /* call */
+          if (cond) {
+            aux = pc;
+            pc = c & ADDR_MASK;
+            reg[15] = aux;
+          }
+        }
+      } else {
+        /* branch target is pc + 4 + offset * 4 */
+        if (v == 0) {
+          /* branch */
+          if (cond) {
+            pc += imm << 2;
+            pc &= ADDR_MASK;
+          }
+        } else {
+          /* call */
+          if (cond) {
+            aux = pc;
+            pc += imm << 2;
+            pc &= ADDR_MASK;
+            reg[15] = aux;
+          }
+        }
+      }
+    }
+  }
+}
+
+
+/*
+ * execution of predecoded instructions
+ */
+
+
+#define OP_U		0x10		/* u bit in decoded op field */
+
+
+static Bool testCond(int cond) {
+  Bool res;
+
+  res = (cond >> 3) & 1;
+  switch (cond & 7) {
+    case 0:
+      res ^= N;
+      break;
+    case 1:
+      res ^= Z;
+      break;
+    case 2:
+      res ^= C;
+      break;
+    case 3:
+      res ^= V;
+      break;
+    case 4:
+      res ^= C | Z;
+      break;
+    case 5:
+      res ^= N ^ V;
+      break;
+    case 6:
+      res ^= (N ^ V) | Z;
+      break;
+    case 7:
+      res ^= true;
+      break;
+  }
+  return res;
+}
+
+
+static void execALU(Decoded *dp, Word d) {
+  Word b;
+  Word res;
+  Word mask;
+  int u;
+
+  b = reg[dp->b];
+  u = (dp->op & OP_U) != 0;
+  switch (dp->op & 0x0F) {
+    case 0x00:
+      /* MOV (general register or immediate) */
+      res = d;
+      break;
+    case 0x01:
+      /* LSL */
+      res = b << (d & 0x1F);
+      break;
+    case 0x02:
+      /* ASR, LSR */
+      if (u == 0) {
+        /* ASR */
+        mask = b & 0x80000000 ?
+                 ~(((Word) 0xFFFFFFFF) >> (d & 0x1F)) : 0x00000000;
+        res = mask | (b >> (d & 0x1F));
+      } else {
+        /* LSR */
+        res = b >> (d & 0x1F);
+      }
+      break;
+    case 0x03:
+      /* ROR */
+      res = (b << (-d & 0x1F)) | (b >> (d & 0x1F));
+      break;
+    case 0x04:
+      /* AND */
+      res = b & d;
+      break;
+    case 0x05:
+      /* ANN */
+      res = b & ~d;
+      break;
+    case 0x06:
+      /* IOR */
+      res = b | d;
+      break;
+    case 0x07:
+      /* XOR */
+      res = b ^ d;
+      break;
+    case 0x08:
+      /* ADD */
+      res = b + d + (u & C);
+      SET_CV(CV_ADD, res, b, d);
+      break;
+    case 0x09:
+      /* SUB */
+      res = b - d - (u & C);
+      SET_CV(CV_SUB, res, b, d);
+      break;
+    case 0x0A:
+      /* MUL */
+      intMul(b, d, u, &res, &H);
+      break;
+    case 0x0B:
+      /* DIV */
+      intDiv(b, d, u, &res, &H);
+      break;
+    default:
+      /* floating-point instructions are never decoded here */
+      error("illegal decoded ALU operation %d", dp->op & 0x0F);
+      res = 0;
+      break;
+  }
+  reg[dp->a] = res;
+  SET_NZ(res);
+}
+
+
+static void execRegALU(Decoded *dp) {
+  execALU(dp, reg[dp->c]);
+}
+
+
+static void execImmALU(Decoded *dp) {
+  execALU(dp, dp->imm);
+}
+
+
+/*
+ * the frequent ALU operations have a handler of their own
+ * for each operand form, so that they need no second dispatch
+ */
+
+
+#define ALU_HANDLERS(name, expr, flags) \
+  static void exec##name##R(Decoded *dp) { \
+    Word b, d; \
+    Word res; \
+ \
+    b = reg[dp->b]; \
+    d = reg[dp->c]; \
+    res = (expr); \
+    flags; \
+    reg[dp->a] = res; \
+    SET_NZ(res); \
+  } \
+  static void exec##name##I(Decoded *dp) { \
+    Word b, d; \
+    Word res; \
+ \
+    b = reg[dp->b]; \
+    d = dp->imm; \
+    res = (expr); \
+    flags; \
+    reg[dp->a] = res; \
+    SET_NZ(res); \
+  }
+
+#define NO_FLAGS	do { } while (0)
+
+ALU_HANDLERS(Lsl, b << (d & 0x1F), NO_FLAGS)
+ALU_HANDLERS(Asr, (b & 0x80000000 ? ~(((Word) 0xFFFFFFFF) >> (d & 0x1F)) : 0) |
+                  (b >> (d & 0x1F)), NO_FLAGS)
+ALU_HANDLERS(Lsr, b >> (d & 0x1F), NO_FLAGS)
+ALU_HANDLERS(Ror, (b << (-d & 0x1F)) | (b >> (d & 0x1F)), NO_FLAGS)
+ALU_HANDLERS(And, b & d, NO_FLAGS)
+ALU_HANDLERS(Ann, b & ~d, NO_FLAGS)
+ALU_HANDLERS(Ior, b | d, NO_FLAGS)
+ALU_HANDLERS(Xor, b ^ d, NO_FLAGS)
+ALU_HANDLERS(Add, b + d, SET_CV(CV_ADD, res, b, d))
+ALU_HANDLERS(Sub, b - d, SET_CV(CV_SUB, res, b, d))
+
+#undef ALU_HANDLERS
+#undef NO_FLAGS
+
+
+static void execMovR(Decoded *dp) {
+  Word res;
+
+  res = reg[dp->c];
+  reg[dp->a] = res;
+  SET_NZ(res);
+}
+
+
+static void execMovI(Decoded *dp) {
+  Word res;
+
+  res = dp->imm;
+  reg[dp->a] = res;
+  SET_NZ(res);
+}
+
+
+/*
+ * handler for an ALU operation (op includes OP_U),
+ * NULL if it is left to the general one
+ */
+static void (*aluHandler(int op, Bool imm))(Decoded *dp) {
+  switch (op) {
+    case 0x00:
+      return imm ? execMovI : execMovR;
+    case 0x00 | OP_U:
+      /* MOV with u = 1 and immediate operand (imm shifted) */
+      return imm ? execMovI : NULL;
+    case 0x01:
+      return imm ? execLslI : execLslR;
+    case 0x02:
+      return imm ? execAsrI : execAsrR;
+    case 0x02 | OP_U:
+      return imm ? execLsrI : execLsrR;
+    case 0x03:
+      return imm ? execRorI : execRorR;
+    case 0x04:
+      return imm ? execAndI : execAndR;
+    case 0x05:
+      return imm ? execAnnI : execAnnR;
+    case 0x06:
+      return imm ? execIorI : execIorR;
+    case 0x07:
+      return imm ? execXorI : execXorR;
+    case 0x08:
+      return imm ? execAddI : execAddR;
+    case 0x09:
+      return imm ? execSubI : execSubR;
+  }
+  return NULL;
+}
+
+
+/* direct host access for RAM (and, reading, PROM) pages */
+static void execLoadWord(Decoded *dp) {
+  Word addr;
+  Byte *host;
+  Word res;
+
+  addr = (reg[dp->b] + dp->imm) & ADDR_MASK;
+  host = pageTable[addr >> MEM_PAGE_SHIFT].rdHost;
+  if (host != NULL && (addr & 3) == 0) {
+    res = *(Word *) (host + (addr & MEM_PAGE_MASK));
+  } else {
+    res = readWord(addr);
+  }
+  reg[dp->a] = res;
+  SET_NZ(res);
+}
+
+
+static void execLoadHalf(Decoded *dp) {
+  Word res;
+
+  res = readHalf(reg[dp->b] + dp->imm);
+  reg[dp->a] = res;
+  SET_NZ(res);
+}
+
+
+static void execLoadByte(Decoded *dp) {
+  Word res;
+
+  res = readByte(reg[dp->b] + dp->imm);
+  reg[dp->a] = res;
+  SET_NZ(res);
+}
+
+
+static void execStoreWord(Decoded *dp) {
+  Word addr;
+  Byte *host;
+
+  addr = (reg[dp->b] + dp->imm) & ADDR_MASK;
+  host = pageTable[addr >> MEM_PAGE_SHIFT].wrHost;
+  if (host != NULL && (addr & 3) == 0) {
+    host += addr & MEM_PAGE_MASK;
+    if (*(Word *) host != reg[dp->a]) {
+      *(Word *) host = reg[dp->a];
+      ramWritten(addr);
+    }
+  } else {
+    writeWord(addr, reg[dp->a]);
+  }
+}
+
+
+static void execStoreHalf(Decoded *dp) {
+  writeHalf(reg[dp->b] + dp->imm, reg[dp->a]);
+}
+
+
+static void execStoreByte(Decoded *dp) {
+  writeByte(reg[dp->b] + dp->imm, reg[dp->a]);
+}
+
+
+static void execBranchReg(Decoded *dp) {
+  if (testCond(dp->op)) {
+    pc = reg[dp->c] & ADDR_MASK;
+  }
+}
+
+
+static void execCallReg(Decoded *dp) {
+  Word aux;
+
+  if (testCond(dp->op)) {
+    aux = pc;
+    pc = reg[dp->c] & ADDR_MASK;
+    reg[15] = aux;
+  }
+}
+
+
+static void execBranchRel(Decoded *dp) {
+  if (testCond(dp->op)) {
+    pc += dp->imm;
+    pc &= ADDR_MASK;
+  }
+}
+
+
+static void execCallRel(Decoded *dp) {
+  Word aux;
+
+  if (testCond(dp->op)) {
+    aux = pc;
+    pc += dp->imm;
+    pc &= ADDR_MASK;
+    reg[15] = aux;
+  }
+}
+
+
+static void execGeneric(Decoded *dp) {
+  /* rarely used instructions: imm holds the instruction itself */
+  execInstruction(dp->imm);
+}
+
+
+static void decodeInstruction(Word ir, Decoded *dp) {
+  int p, q, u, v;
+  int op;
+
+  p = (ir >> 31) & 0x01;
+  q = (ir >> 30) & 0x01;
+  u = (ir >> 29) & 0x01;
+  v = (ir >> 28) & 0x01;
+  op = (ir >> 16) & 0x0F;
+  dp->a = (ir >> 24) & 0x0F;
+  dp->b = (ir >> 20) & 0x0F;
+  dp->c = ir & 0x0F;
+  dp->op = op | (u ? OP_U : 0);
+  dp->imm = ir;
+  dp->h.exec = execGeneric;
+  if (p == 0) {
+    /* register instructions */
+    if (op >= 0x0C) {
+      /* floating-point: always uses register c */
+      return;
+    }
+    if (q == 0) {
+      /* register operand */
+      if (op == 0x00 && u != 0) {
+        /* special register access */
+        return;
+      }
+      dp->h.exec = aluHandler(dp->op, false);
+      if (dp->h.exec == NULL) {
+        dp->h.exec = execRegALU;
+      }
+    } else {
+      /* immediate operand */
+      dp->imm = (v ? 0xFFFF0000 : 0x00000000) | (ir & 0x0000FFFF);
+      if (op == 0x00 && u != 0) {
+        dp->imm <<= 16;
+      }
+      dp->h.exec = aluHandler(dp->op, true);
+      if (dp->h.exec == NULL) {
+        dp->h.exec = execImmALU;
+      }
+    }
+  } else {
+    if (q == 0) {
+      /* memory instructions */
+      if (v == 0) {
+        /* word/half */
+        if ((ir & 1) == 0) {
+          dp->imm = SIGN_EXT_20(ir & 0x000FFFFC);
+          dp->h.exec = u ? execStoreWord : execLoadWord;
+        } else {
+          dp->imm = SIGN_EXT_20(ir & 0x000FFFFE);
+          dp->h.exec = u ? execStoreHalf : execLoadHalf;
         }
       } else {
-        /* branch target is pc + 4 + offset * 4 */
+        /* byte */
+        dp->imm = SIGN_EXT_20(ir & 0x000FFFFF);
+        dp->h.exec = u ? execStoreByte : execLoadByte;
+      }
+    } else {
+      /* branch instructions */
+      dp->op = dp->a;
+      if (u == 0) {
+        /* branch target is in register */
         if (v == 0) {
-          /* branch */
-          if (cond) {
-            pc += imm << 2;
-            pc &= ADDR_MASK;
+          if (((ir >> 4) & 3) == 0) {
+            dp->h.exec = execBranchReg;
           }
+          /* interrupt handling is left to the generic handler */
         } else {
-          /* call */
-          if (cond) {
-            aux = pc;
-            pc += imm << 2;
-            pc &= ADDR_MASK;
-            reg[15] = aux;
-          }
+          dp->h.exec = execCallReg;
         }
+      } else {
+        /* branch target is pc + 4 + offset * 4 */
+        dp->imm = (ir & 0x003FFFFF) << 2;
+        dp->h.exec = v ? execCallRel : execBranchRel;
+      }
+    }
+  }
+}
+
+
+static void execNextInstruction(void) {
+  Word ir;
+  Decoded *dp;
+
+  if (decodeCache) {
+    dp = lookupDecoded(pc);
+    if (dp != NULL) {
+      if (dp->h.exec == NULL) {
+        decodeInstruction(readWord(pc), dp);
       }
+      pc += 4;
+      pc &= ADDR_MASK;
+      (*dp->h.exec)(dp);
+      return;
     }
   }
+  ir = readWord(pc);
+  pc += 4;
+  pc &= ADDR_MASK;
+  execInstruction(ir);
 }
 
 
@@ -2555,6 +4849,7 @@ static void handleInterrupts(void) {
   }
   /* acknowledge exception, or interrupt if enabled */
   if (priority >= 16 || I) {
+    idleQuiet = false;
     if (priority >= 16) {
       /* clear corresponding bit in irqPending vector */
       /* only done for exceptions, since interrupts are level-sensitive */
@@ -2631,10 +4926,8 @@ Word cpuGetPSW(void) {
 
 
 void cpuSetPSW(Word value) {
-  N = (value >> 31) & 1;
-  Z = (value >> 30) & 1;
-  C = (value >> 29) & 1;
-  V = (value >> 28) & 1;
+  setFlags((value >> 31) & 1, (value >> 30) & 1,
+           (value >> 29) & 1, (value >> 28) & 1);
   I = (value >> 27) & 1;
   P = (value >> 26) & 1;
   irqAck = (value >> 16) & 0x0000001F;
@@ -2668,63 +4961,949 @@ void cpuResetBreak(void) {
 }
 
 
-void cpuStep(void) {
-  tickTimer();
-  tickRS232_0();
-  tickRS232_1();
-  tickHPT_0();
-  tickHPT_1();
-  execNextInstruction();
-  handleInterrupts();
+/*
+ * threaded-code execution engine
+ *     each instruction form has its own handler, and the decoded
+ *     instruction holds the address of the handler's code (computed
+ *     goto with GCC, a switch on the form number otherwise)
+ */
+
+
+#ifdef __GNUC__
+#define DIRECT_THREADED
+#endif
+
+
+static Bool threaded = false;	/* use threaded-code engine if true */
+
+
+enum {
+  /* register forms */
+  F_MOV_R, F_LSL_R, F_ASR_R, F_LSR_R, F_ROR_R, F_AND_R, F_ANN_R, F_IOR_R,
+  F_XOR_R, F_ADD_R, F_ADC_R, F_SUB_R, F_SBC_R, F_MUL_R, F_MULU_R,
+  F_DIV_R, F_DIVU_R,
+  /* immediate forms */
+  F_MOV_I, F_LSL_I, F_ASR_I, F_LSR_I, F_ROR_I, F_AND_I, F_ANN_I, F_IOR_I,
+  F_XOR_I, F_ADD_I, F_ADC_I, F_SUB_I, F_SBC_I, F_MUL_I, F_MULU_I,
+  F_DIV_I, F_DIVU_I,
+  /* memory forms */
+  F_LDW, F_LDH, F_LDB, F_STW, F_STH, F_STB,
+  /* branch forms, four for each condition */
+#define BRANCH_FORMS(cc)	F_BR_##cc, F_CR_##cc, F_B_##cc, F_C_##cc
+  BRANCH_FORMS(MI), BRANCH_FORMS(EQ), BRANCH_FORMS(CS), BRANCH_FORMS(VS),
+  BRANCH_FORMS(LS), BRANCH_FORMS(LT), BRANCH_FORMS(LE), BRANCH_FORMS(AL),
+  BRANCH_FORMS(PL), BRANCH_FORMS(NE), BRANCH_FORMS(CC), BRANCH_FORMS(VC),
+  BRANCH_FORMS(HI), BRANCH_FORMS(GE), BRANCH_FORMS(GT), BRANCH_FORMS(NV),
+#undef BRANCH_FORMS
+  /* everything else */
+  F_GENERIC,
+  NUM_FORMS
+};
+
+
+static int threadForm(Word ir) {
+  int p, q, u, v;
+  int op;
+  int form;
+
+  p = (ir >> 31) & 0x01;
+  q = (ir >> 30) & 0x01;
+  u = (ir >> 29) & 0x01;
+  v = (ir >> 28) & 0x01;
+  op = (ir >> 16) & 0x0F;
+  if (p == 0) {
+    /* register instructions */
+    if (op >= 0x0C || (op == 0x00 && q == 0 && u != 0)) {
+      /* floating-point or special register access */
+      return F_GENERIC;
+    }
+    switch (op) {
+      case 0x00:
+        form = F_MOV_R;
+        break;
+      case 0x01:
+        form = F_LSL_R;
+        break;
+      case 0x02:
+        form = u ? F_LSR_R : F_ASR_R;
+        break;
+      case 0x03:
+        form = F_ROR_R;
+        break;
+      case 0x04:
+        form = F_AND_R;
+        break;
+      case 0x05:
+        form = F_ANN_R;
+        break;
+      case 0x06:
+        form = F_IOR_R;
+        break;
+      case 0x07:
+        form = F_XOR_R;
+        break;
+      case 0x08:
+        form = u ? F_ADC_R : F_ADD_R;
+        break;
+      case 0x09:
+        form = u ? F_SBC_R : F_SUB_R;
+        break;
+      case 0x0A:
+        form = u ? F_MULU_R : F_MUL_R;
+        break;
+      default:
+        form = u ? F_DIVU_R : F_DIV_R;
+        break;
+    }
+    return q ? form + (F_MOV_I - F_MOV_R) : form;
+  }
+  if (q == 0) {
+    /* memory instructions */
+    if (v == 0) {
+      if ((ir & 1) == 0) {
+        return u ? F_STW : F_LDW;
+      }
+      return u ? F_STH : F_LDH;
+    }
+    return u ? F_STB : F_LDB;
+  }
+  /* branch instructions */
+  form = F_BR_MI + 4 * ((ir >> 24) & 0x0F);
+  if (u == 0) {
+    if (v == 0) {
+      /* interrupt handling is left to the generic handler */
+      return ((ir >> 4) & 3) == 0 ? form : F_GENERIC;
+    }
+    return form + 1;
+  }
+  return v ? form + 3 : form + 2;
+}
+
+
+static void threadInstruction(Word ir, Decoded *dp,
+                              const void * const *labels) {
+  int form;
+
+  /* register numbers and immediate values as for the decoded engine */
+  decodeInstruction(ir, dp);
+  form = threadForm(ir);
+  if (form == F_GENERIC) {
+    dp->imm = ir;
+  }
+  dp->op = form;
+  dp->h.label = labels[form];
+}
+
+
+#ifdef DIRECT_THREADED
+#define HANDLER(f)	L_##f:
+#define DISPATCH(dp)	goto *(dp)->h.label;
+#else
+#define HANDLER(f)	case f:
+#define DISPATCH(dp)	switch ((dp)->op)
+#endif
+
+#define ALU_FORMS(f, expr) \
+  HANDLER(f##_R) \
+    b = reg[dp->b]; \
+    d = reg[dp->c]; \
+    res = (expr); \
+    goto writeback; \
+  HANDLER(f##_I) \
+    b = reg[dp->b]; \
+    d = dp->imm; \
+    res = (expr); \
+    goto writeback;
+
+/* direct host access for RAM (and, reading, PROM) pages */
+#define LOAD_FORM(f, align, type, slow) \
+  HANDLER(f) \
+    addr = (reg[dp->b] + dp->imm) & ADDR_MASK; \
+    host = pageTable[addr >> MEM_PAGE_SHIFT].rdHost; \
+    if (host != NULL && (addr & (align)) == 0) { \
+      res = *(type *) (host + (addr & MEM_PAGE_MASK)); \
+    } else { \
+      res = slow(addr); \
+    } \
+    goto writeback;
+
+#define STORE_FORM(f, align, type, slow) \
+  HANDLER(f) \
+    addr = (reg[dp->b] + dp->imm) & ADDR_MASK; \
+    host = pageTable[addr >> MEM_PAGE_SHIFT].wrHost; \
+    if (host != NULL && (addr & (align)) == 0) { \
+      host += addr & MEM_PAGE_MASK; \
+      if (*(type *) host != (type) reg[dp->a]) { \
+        *(type *) host = reg[dp->a]; \
+        ramDecoded[(addr - RAM_BASE) >> 2].h.exec = NULL; \
+        idleQuiet = false; \
+      } \
+    } else { \
+      slow(addr, reg[dp->a]); \
+    } \
+    goto done;
+
+#define BRANCH_HANDLERS(cc, cond) \
+  HANDLER(F_BR_##cc) \
+    if (cond) { \
+      pc = reg[dp->c] & ADDR_MASK; \
+    } \
+    goto done; \
+  HANDLER(F_CR_##cc) \
+    if (cond) { \
+      aux = pc; \
+      pc = reg[dp->c] & ADDR_MASK; \
+      reg[15] = aux; \
+    } \
+    goto done; \
+  HANDLER(F_B_##cc) \
+    if (cond) { \
+      pc += dp->imm; \
+      pc &= ADDR_MASK; \
+    } \
+    goto done; \
+  HANDLER(F_C_##cc) \
+    if (cond) { \
+      aux = pc; \
+      pc += dp->imm; \
+      pc &= ADDR_MASK; \
+      reg[15] = aux; \
+    } \
+    goto done;
+
+
+static void runThreaded(Bool single) {
+#ifdef DIRECT_THREADED
+#define BRANCH_LABELS(cc) \
+  &&L_F_BR_##cc, &&L_F_CR_##cc, &&L_F_B_##cc, &&L_F_C_##cc
+  static const void * const labels[NUM_FORMS] = {
+    &&L_F_MOV_R, &&L_F_LSL_R, &&L_F_ASR_R, &&L_F_LSR_R,
+    &&L_F_ROR_R, &&L_F_AND_R, &&L_F_ANN_R, &&L_F_IOR_R,
+    &&L_F_XOR_R, &&L_F_ADD_R, &&L_F_ADC_R, &&L_F_SUB_R,
+    &&L_F_SBC_R, &&L_F_MUL_R, &&L_F_MULU_R, &&L_F_DIV_R,
+    &&L_F_DIVU_R,
+    &&L_F_MOV_I, &&L_F_LSL_I, &&L_F_ASR_I, &&L_F_LSR_I,
+    &&L_F_ROR_I, &&L_F_AND_I, &&L_F_ANN_I, &&L_F_IOR_I,
+    &&L_F_XOR_I, &&L_F_ADD_I, &&L_F_ADC_I, &&L_F_SUB_I,
+    &&L_F_SBC_I, &&L_F_MUL_I, &&L_F_MULU_I, &&L_F_DIV_I,
+    &&L_F_DIVU_I,
+    &&L_F_LDW, &&L_F_LDH, &&L_F_LDB, &&L_F_STW, &&L_F_STH, &&L_F_STB,
+    BRANCH_LABELS(MI), BRANCH_LABELS(EQ), BRANCH_LABELS(CS),
+    BRANCH_LABELS(VS), BRANCH_LABELS(LS), BRANCH_LABELS(LT),
+    BRANCH_LABELS(LE), BRANCH_LABELS(AL), BRANCH_LABELS(PL),
+    BRANCH_LABELS(NE), BRANCH_LABELS(CC), BRANCH_LABELS(VC),
+    BRANCH_LABELS(HI), BRANCH_LABELS(GE), BRANCH_LABELS(GT),
+    BRANCH_LABELS(NV),
+    &&L_F_GENERIC,
+  };
+#undef BRANCH_LABELS
+#else
+  /* any non-NULL pointer marks a decoded instruction */
+  static const Byte valid[NUM_FORMS];
+  static PER_MACHINE const void *labels[NUM_FORMS];
+  int i;
+
+  if (labels[0] == NULL) {
+    for (i = 0; i < NUM_FORMS; i++) {
+      labels[i] = &valid[i];
+    }
+  }
+#endif
+  Decoded *dp;
+  Word ir;
+  Word b, d;
+  Word res;
+  Word aux;
+  Word addr;
+  Byte *host;
+
+next:
+  if (++simTime >= nextEvent) {
+    tickDevices();
+  }
+  dp = lookupDecoded(pc);
+  if (dp == NULL) {
+    /* not in RAM or PROM: fetch and execute without caching */
+    ir = readWord(pc);
+    pc += 4;
+    pc &= ADDR_MASK;
+    execInstruction(ir);
+    goto done;
+  }
+  if (dp->h.label == NULL) {
+    threadInstruction(readWord(pc), dp, labels);
+  }
+  pc += 4;
+  pc &= ADDR_MASK;
+  DISPATCH(dp) {
+    HANDLER(F_MOV_R)
+      res = reg[dp->c];
+      goto writeback;
+    HANDLER(F_MOV_I)
+      res = dp->imm;
+      goto writeback;
+    ALU_FORMS(F_LSL, b << (d & 0x1F))
+    ALU_FORMS(F_ASR, (b & 0x80000000 ?
+                      ~(((Word) 0xFFFFFFFF) >> (d & 0x1F)) : 0x00000000) |
+                     (b >> (d & 0x1F)))
+    ALU_FORMS(F_LSR, b >> (d & 0x1F))
+    ALU_FORMS(F_ROR, (b << (-d & 0x1F)) | (b >> (d & 0x1F)))
+    ALU_FORMS(F_AND, b & d)
+    ALU_FORMS(F_ANN, b & ~d)
+    ALU_FORMS(F_IOR, b | d)
+    ALU_FORMS(F_XOR, b ^ d)
+    HANDLER(F_ADD_R)
+      b = reg[dp->b];
+      d = reg[dp->c];
+      res = b + d;
+      goto addFlags;
+    HANDLER(F_ADD_I)
+      b = reg[dp->b];
+      d = dp->imm;
+      res = b + d;
+      goto addFlags;
+    HANDLER(F_ADC_R)
+      b = reg[dp->b];
+      d = reg[dp->c];
+      res = b + d + C;
+      goto addFlags;
+    HANDLER(F_ADC_I)
+      b = reg[dp->b];
+      d = dp->imm;
+      res = b + d + C;
+      goto addFlags;
+    HANDLER(F_SUB_R)
+      b = reg[dp->b];
+      d = reg[dp->c];
+      res = b - d;
+      goto subFlags;
+    HANDLER(F_SUB_I)
+      b = reg[dp->b];
+      d = dp->imm;
+      res = b - d;
+      goto subFlags;
+    HANDLER(F_SBC_R)
+      b = reg[dp->b];
+      d = reg[dp->c];
+      res = b - d - C;
+      goto subFlags;
+    HANDLER(F_SBC_I)
+      b = reg[dp->b];
+      d = dp->imm;
+      res = b - d - C;
+      goto subFlags;
+    HANDLER(F_MUL_R)
+      intMul(reg[dp->b], reg[dp->c], false, &res, &H);
+      goto writeback;
+    HANDLER(F_MUL_I)
+      intMul(reg[dp->b], dp->imm, false, &res, &H);
+      goto writeback;
+    HANDLER(F_MULU_R)
+      intMul(reg[dp->b], reg[dp->c], true, &res, &H);
+      goto writeback;
+    HANDLER(F_MULU_I)
+      intMul(reg[dp->b], dp->imm, true, &res, &H);
+      goto writeback;
+    HANDLER(F_DIV_R)
+      intDiv(reg[dp->b], reg[dp->c], false, &res, &H);
+      goto writeback;
+    HANDLER(F_DIV_I)
+      intDiv(reg[dp->b], dp->imm, false, &res, &H);
+      goto writeback;
+    HANDLER(F_DIVU_R)
+      intDiv(reg[dp->b], reg[dp->c], true, &res, &H);
+      goto writeback;
+    HANDLER(F_DIVU_I)
+      intDiv(reg[dp->b], dp->imm, true, &res, &H);
+      goto writeback;
+    LOAD_FORM(F_LDW, 3, Word, readWord)
+    STORE_FORM(F_STW, 3, Word, writeWord)
+#ifdef HOST_SUBWORD
+    LOAD_FORM(F_LDH, 1, HostHalf, readHalf)
+    LOAD_FORM(F_LDB, 0, Byte, readByte)
+    STORE_FORM(F_STH, 1, HostHalf, writeHalf)
+    STORE_FORM(F_STB, 0, Byte, writeByte)
+#else
+    HANDLER(F_LDH)
+      res = readHalf(reg[dp->b] + dp->imm);
+      goto writeback;
+    HANDLER(F_LDB)
+      res = readByte(reg[dp->b] + dp->imm);
+      goto writeback;
+    HANDLER(F_STH)
+      writeHalf(reg[dp->b] + dp->imm, reg[dp->a]);
+      goto done;
+    HANDLER(F_STB)
+      writeByte(reg[dp->b] + dp->imm, reg[dp->a]);
+      goto done;
+#endif
+    BRANCH_HANDLERS(MI, N)
+    BRANCH_HANDLERS(EQ, Z)
+    BRANCH_HANDLERS(CS, C)
+    BRANCH_HANDLERS(VS, V)
+    BRANCH_HANDLERS(LS, C | Z)
+    BRANCH_HANDLERS(LT, N ^ V)
+    BRANCH_HANDLERS(LE, (N ^ V) | Z)
+    BRANCH_HANDLERS(AL, true)
+    BRANCH_HANDLERS(PL, !N)
+    BRANCH_HANDLERS(NE, !Z)
+    BRANCH_HANDLERS(CC, !C)
+    BRANCH_HANDLERS(VC, !V)
+    BRANCH_HANDLERS(HI, !(C | Z))
+    BRANCH_HANDLERS(GE, !(N ^ V))
+    BRANCH_HANDLERS(GT, !((N ^ V) | Z))
+    BRANCH_HANDLERS(NV, false)
+    HANDLER(F_GENERIC)
+      execInstruction(dp->imm);
+      goto done;
+  }
+addFlags:
+  SET_CV(CV_ADD, res, b, d);
+  goto writeback;
+subFlags:
+  SET_CV(CV_SUB, res, b, d);
+writeback:
+  reg[dp->a] = res;
+  SET_NZ(res);
+  goto done;
+done:
+  handleInterrupts();
+  if (single) {
+    return;
+  }
+  if (breakSet && pc == breakAddr) {
+    SET_RUN(false);
+  }
+  if (RUNNING()) {
+    goto next;
+  }
+}
+
+
+#undef HANDLER
+#undef DISPATCH
+#undef ALU_FORMS
+#undef LOAD_FORM
+#undef STORE_FORM
+#undef BRANCH_HANDLERS
+
+
+/*
+ * idle detection
+ *     A program waiting for input polls the millisecond timer,
+ *     the mouse and the keyboard in a loop which has no other
+ *     side effects. If a poll instruction is reached again with
+ *     the same CPU state, and nothing has happened in between
+ *     (no memory contents changed, no other device accessed,
+ *     no event fired, no interrupt taken), the loop will repeat
+ *     exactly until the next device event is due. All rounds
+ *     of the loop up to that point are skipped by advancing
+ *     the simulated time, and the host sleeps for the time
+ *     skipped (or until the next input event arrives).
+ */
+
+
+#define IDLE_LOOP_MAX	INST_PER_MSEC	/* longest loop detected */
+#define IDLE_STATE	21		/* PC, regs, H, X, PSW, IRQs */
+
+
+static Bool idleDetect = true;		/* skip idle loops if true */
+static PER_MACHINE Bool idleHalt = false;	/* halt at next input wait if true */
+static PER_MACHINE Bool idleInput;		/* loop polls mouse or keyboard */
+static PER_MACHINE Word idleData[16];		/* last data read from device */
+static PER_MACHINE Word idlePC;			/* the poll which started the loop */
+static PER_MACHINE Time idleStart;		/* when it was reached */
+static PER_MACHINE Word idleState[IDLE_STATE];	/* CPU state at that time */
+static PER_MACHINE long long idleOwed = 0;	/* time skipped minus time slept */
+
+
+static void idleGetState(Word *state) {
+  int i;
+
+  state[0] = pc;
+  for (i = 0; i < 16; i++) {
+    state[1 + i] = reg[i];
+  }
+  state[17] = H;
+  state[18] = X;
+  state[19] = cpuGetPSW();
+  state[20] = irqPending;
+}
+
+
+static void idleSkip(Time length) {
+  Time rounds;
+  long long start;
+
+  if (numEvents == 0) {
+    return;
+  }
+  /* every skipped round must end before the next event */
+  rounds = (eventHeap[0]->due - 1 - simTime) / length;
+  simTime += rounds * length;
+  skippedTime += rounds * length;
+  if (paced) {
+    /* pacing sleeps anyway */
+    return;
+  }
+  idleOwed += rounds * length;
+  if (idleOwed >= INST_PER_MSEC) {
+    /* sleeping longer than asked for is paid back later */
+    start = hostMicroSeconds();
+    mouseKeybdWait(idleOwed * 1000 / INST_PER_MSEC);
+    idleOwed -= (hostMicroSeconds() - start) * INST_PER_MSEC / 1000;
+  }
+}
+
+
+/*
+ * called after every read from an I/O device
+ */
+void cpuIdleRead(int dev, Word data) {
+  Word state[IDLE_STATE];
+
+  if (dev != 0 && dev != 6 && (dev != 7 || data != 0)) {
+    /* not a poll, or a key code has been consumed */
+    idleQuiet = false;
+    return;
+  }
+  if (data != idleData[dev]) {
+    idleData[dev] = data;
+    idleQuiet = false;
+  }
+  if (!idleDetect || !RUNNING()) {
+    return;
+  }
+  if (idleQuiet) {
+    if (pc != idlePC) {
+      if (simTime - idleStart <= IDLE_LOOP_MAX) {
+        /* another poll within the loop */
+        idleInput |= (dev != 0);
+        return;
+      }
+    } else {
+      idleGetState(state);
+      if (memcmp(state, idleState, sizeof(state)) == 0) {
+        if (idleHalt && idleInput) {
+          /* booted: waiting for input, not just for time to pass */
+          idleHalt = false;
+          SET_RUN(false);
+        } else {
+          idleSkip(simTime - idleStart);
+        }
+      }
+    }
+  }
+  /* watch for a loop starting at this poll */
+  idleInput = (dev != 0);
+  idlePC = pc;
+  idleStart = simTime;
+  idleGetState(idleState);
+  idleQuiet = true;
+}
+
+
+void cpuStep(void) {
+  if (threaded) {
+    runThreaded(true);
+    return;
+  }
+  if (++simTime >= nextEvent) {
+    tickDevices();
+  }
+  execNextInstruction();
+  handleInterrupts();
+}
+
+
+void cpuRun(void) {
+  SET_RUN(true);
+  idleQuiet = false;
+  hostStartRun();
+  if (threaded) {
+    runThreaded(false);
+  } else {
+    while (RUNNING()) {
+      if (++simTime >= nextEvent) {
+        tickDevices();
+      }
+      execNextInstruction();
+      if (irqPending != 0) {
+        handleInterrupts();
+      }
+      if (breakSet && pc == breakAddr) {
+        SET_RUN(false);
+      }
+    }
+  }
+  hostStopRun();
+}
+
+
+void cpuHalt(void) {
+  SET_RUN(false);
+}
+
+
+void cpuSetInterrupt(int priority) {
+  irqPending |= ((unsigned) 1 << priority);
+}
+
+
+void cpuResetInterrupt(int priority) {
+  irqPending &= ~((unsigned) 1 << priority);
+}
+
+
+void cpuInit(Word initialPC) {
+  int i;
+
+  pc = initialPC;
+  for (i = 0; i < 16; i++) {
+    reg[i] = 0;
+  }
+  ID = CPU_ID;
+  H = 0;
+  X = 0;
+  setFlags(false, false, false, false);
+  I = P = false;
+  irqAck = 0;
+  irqMask = 0;
+  breakSet = false;
+}
+
+
+/**************************************************************/
+
+/*
+ * machine snapshots
+ *     A snapshot holds the state of the CPU and all devices,
+ *     the PROM, and the RAM including the frame buffer. The
+ *     RAM image is page-aligned in the file, so that it can
+ *     be mapped (copy-on-write) instead of being read. The
+ *     disk image is not part of the snapshot, but it must be
+ *     the same as when the snapshot was taken. Snapshots are
+ *     only portable between hosts of the same byte order.
+ */
+
+
+#define SNAP_MAGIC	0x50414E53	/* 'SNAP' */
+#define SNAP_VERSION	5
+#define SNAP_ALIGN	0x10000		/* RAM offset in file */
+
+
+typedef struct {
+  Word magic;
+  Word version;
+  Word stateSize;		/* bytes of CPU and device state */
+  Word ramOffset;		/* file offset of the RAM image */
+  long long diskSize;		/* -1 if there is no disk */
+  long long diskMTime;		/* nanoseconds */
+  unsigned long long diskHash;	/* of the disk contents */
+  long long diskPos;		/* byte position of the SD card */
+} SnapHeader;
+
+
+typedef struct {
+  void *addr;
+  int size;
+} SnapItem;
+
+
+#define MAX_SNAP_ITEMS	100
+
+static PER_MACHINE SnapItem snapItems[MAX_SNAP_ITEMS];
+static PER_MACHINE Event *snapEvents[MAX_EVENTS];
+static PER_MACHINE int numSnapItems;
+static PER_MACHINE int numSnapEvents;
+
+
+/*
+ * list the state to be saved; this must be done at run time,
+ * as the variables are located anew in every thread
+ */
+#define SNAP(v)		{ &(v), sizeof(v) }
+
+static void snapFindState(void) {
+  SnapItem items[] = {
+    /* CPU */
+    SNAP(pc), SNAP(reg), SNAP(H), SNAP(X), SNAP(I), SNAP(P),
+    SNAP(irqAck), SNAP(irqMask), SNAP(irqPending),
+    SNAP(nzRes), SNAP(cvOp), SNAP(cvRes), SNAP(cvB), SNAP(cvD),
+    SNAP(fixedC), SNAP(fixedV),
+    SNAP(eagerN), SNAP(eagerZ), SNAP(eagerC), SNAP(eagerV),
+    /* time */
+    SNAP(simTime), SNAP(hostRunTotal), SNAP(paceLag), SNAP(skippedTime),
+    /* timer, switches, LEDs */
+    SNAP(milliSeconds), SNAP(timerControl), SNAP(timerExpired),
+    SNAP(currentSwitches), SNAP(currentLEDs),
+    /* serial lines */
+    SNAP(serialRcvData_0), SNAP(serialXmtData_0),
+    SNAP(serialStatus_0), SNAP(serialControl_0), SNAP(serialRate_0),
+    SNAP(serialRcvData_1), SNAP(serialXmtData_1),
+    SNAP(serialStatus_1), SNAP(serialControl_1), SNAP(serialRate_1),
+    /* SPI and SD card */
+    SNAP(spiSelect), SNAP(diskState), SNAP(diskOffset),
+    SNAP(diskRxBuf), SNAP(diskRxIdx),
+    SNAP(diskTxBuf), SNAP(diskTxCnt), SNAP(diskTxIdx), SNAP(diskTxMapped),
+    SNAP(diskMulti), SNAP(diskBlocks), SNAP(csd),
+    /* high-precision timers */
+    SNAP(HPTcounter_0), SNAP(HPTtime_0), SNAP(HPTdivisor_0),
+    SNAP(HPTstatus_0), SNAP(HPTcontrol_0),
+    SNAP(HPTcounter_1), SNAP(HPTtime_1), SNAP(HPTdivisor_1),
+    SNAP(HPTstatus_1), SNAP(HPTcontrol_1),
+    /* LCD, buttons and switches */
+    SNAP(lcd_line), SNAP(lcd_addr_cnt), SNAP(lcd_cgram_acc),
+    SNAP(lcd_display_on), SNAP(lcd_cursor_on), SNAP(lcd_blink_on),
+    SNAP(lcd_inc), SNAP(lcd_shift), SNAP(lcd_busy_flg),
+    SNAP(data_ibuf), SNAP(data_obuf), SNAP(ctrl_ibuf),
+    SNAP(BTNSWTstatus), SNAP(BTNSWTcontrol),
+    /* paravirtual block device */
+    SNAP(PVDsector), SNAP(PVDaddr), SNAP(PVDcount), SNAP(PVDstatus),
+  };
+  /* pacing is not saved, it depends on the command line */
+  Event *events[] = {
+    &timerEvent,
+    &rcvEvent_0, &xmtEvent_0, &emptyEvent_0,
+    &rcvEvent_1, &xmtEvent_1, &emptyEvent_1,
+    &HPTevent_0, &HPTevent_1,
+  };
+
+  numSnapItems = sizeof(items) / sizeof(items[0]);
+  numSnapEvents = sizeof(events) / sizeof(events[0]);
+  memcpy(snapItems, items, sizeof(items));
+  memcpy(snapEvents, events, sizeof(events));
+}
+
+#undef SNAP
+
+
+typedef struct {
+  Time due;			/* valid if scheduled */
+  Time fired;
+  Bool scheduled;
+} SnapEvent;
+
+
+static Word snapStateSize(void) {
+  Word size;
+  int i;
+
+  snapFindState();
+  size = numSnapEvents * sizeof(SnapEvent);
+  for (i = 0; i < numSnapItems; i++) {
+    size += snapItems[i].size;
+  }
+  return size;
 }
 
 
-void cpuRun(void) {
-  run = true;
-  while (run) {
-    tickTimer();
-    tickRS232_0();
-    tickRS232_1();
-    tickHPT_0();
-    tickHPT_1();
-    execNextInstruction();
-    handleInterrupts();
-    if (breakSet && pc == breakAddr) {
-      run = false;
+/*
+ * describe the disk image: size, modification time, and
+ * a hash of its contents (only computed if wanted)
+ */
+static void snapDisk(SnapHeader *hp, Bool hash) {
+  struct stat st;
+  unsigned long long h;
+  unsigned long long *p;
+  long long i, n;
+
+  hp->diskSize = -1;
+  hp->diskMTime = 0;
+  hp->diskHash = 0;
+  hp->diskPos = 0;
+  if (diskMap == NULL) {
+    return;
+  }
+  if (fstat(diskFd, &st) < 0) {
+    error("cannot stat disk image");
+  }
+  hp->diskSize = st.st_size;
+  if (ovlMap != NULL && fstat(ovlFd, &st) < 0) {
+    /* the overlay holds all changes */
+    error("cannot stat disk overlay");
+  }
+  hp->diskMTime = fileMTime(&st);
+  hp->diskPos = (long long) diskSector * 512;
+  if (!hash) {
+    return;
+  }
+  /* FNV-1a on 64-bit words, as seen by the machine */
+  h = 0xCBF29CE484222325ULL;
+  for (n = 0; n < diskSectors; n++) {
+    p = (unsigned long long *) diskSectorData(n);
+    for (i = 0; i < 512 / sizeof(*p); i++) {
+      h ^= p[i];
+      h *= 0x100000001B3ULL;
     }
   }
+  hp->diskHash = h;
+}
+
+
+void snapSave(char *snapName) {
+  FILE *snapFile;
+  SnapHeader hdr;
+  SnapEvent se;
+  Word i;
+
+  snapFile = fopen(snapName, "w");
+  if (snapFile == NULL) {
+    error("cannot open snapshot file '%s' for writing", snapName);
+  }
+  hdr.magic = SNAP_MAGIC;
+  hdr.version = SNAP_VERSION;
+  hdr.stateSize = snapStateSize();
+  hdr.ramOffset = (sizeof(hdr) + hdr.stateSize + ROM_SIZE +
+                   SNAP_ALIGN - 1) & ~(SNAP_ALIGN - 1);
+  snapDisk(&hdr, true);
+  fwrite(&hdr, sizeof(hdr), 1, snapFile);
+  for (i = 0; i < numSnapItems; i++) {
+    fwrite(snapItems[i].addr, snapItems[i].size, 1, snapFile);
+  }
+  for (i = 0; i < numSnapEvents; i++) {
+    se.due = snapEvents[i]->due;
+    se.fired = snapEvents[i]->fired;
+    se.scheduled = snapEvents[i]->slot >= 0;
+    fwrite(&se, sizeof(se), 1, snapFile);
+  }
+  fwrite(rom, ROM_SIZE, 1, snapFile);
+  /* the frame buffer part of the RAM is not used otherwise */
+  for (i = 0; i < GRAPH_SIZE; i += 4) {
+    ram[(GRAPH_BASE - RAM_BASE + i) >> 2] = graphRead(i >> 2);
+  }
+  fseek(snapFile, hdr.ramOffset, SEEK_SET);
+  if (fwrite(ram, RAM_SIZE, 1, snapFile) != 1 ||
+      fclose(snapFile) != 0) {
+    error("cannot write snapshot file '%s'", snapName);
+  }
+  printf("Machine snapshot written to file '%s'\n", snapName);
+}
+
+
+void snapRestore(char *snapName) {
+  int fd;
+  struct stat st;
+  SnapHeader hdr;
+  SnapHeader disk;
+  Byte *head;
+  Byte *p;
+  SnapEvent se;
+  Word i;
+
+  fd = open(snapName, O_RDONLY);
+  if (fd < 0) {
+    error("cannot open snapshot file '%s'", snapName);
+  }
+  if (fstat(fd, &st) < 0 ||
+      read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    error("snapshot file '%s' is damaged", snapName);
+  }
+  if (hdr.magic != SNAP_MAGIC ||
+      hdr.version != SNAP_VERSION ||
+      hdr.stateSize != snapStateSize()) {
+    error("file '%s' is not a snapshot of this simulator", snapName);
+  }
+  if (st.st_size != hdr.ramOffset + RAM_SIZE) {
+    error("snapshot file '%s' is damaged", snapName);
+  }
+  /* the disk must not have changed since the snapshot */
+  snapDisk(&disk, false);
+  if (disk.diskSize != hdr.diskSize) {
+    error("disk image does not match snapshot '%s'", snapName);
+  }
+  if (disk.diskMTime != hdr.diskMTime) {
+    /* maybe just copied: compare the contents */
+    snapDisk(&disk, true);
+    if (disk.diskHash != hdr.diskHash) {
+      error("disk image has changed since snapshot '%s'", snapName);
+    }
+  }
+  if (diskMap != NULL) {
+    diskSector = hdr.diskPos / 512;
+  }
+  /* CPU and device state */
+  head = mmap(NULL, hdr.ramOffset, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (head == MAP_FAILED) {
+    error("cannot map snapshot file '%s'", snapName);
+  }
+  p = head + sizeof(hdr);
+  for (i = 0; i < numSnapItems; i++) {
+    memcpy(snapItems[i].addr, p, snapItems[i].size);
+    p += snapItems[i].size;
+  }
+  for (i = 0; i < numSnapEvents; i++) {
+    memcpy(&se, p, sizeof(se));
+    p += sizeof(se);
+    eventCancel(snapEvents[i]);
+    snapEvents[i]->fired = se.fired;
+    if (se.scheduled) {
+      eventSchedule(snapEvents[i], se.due);
+    }
+  }
+  memcpy(rom, p, ROM_SIZE);
+  munmap(head, hdr.ramOffset);
+  /* the RAM is mapped, and only read when touched */
+  memExit();
+  ram = mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+             fd, hdr.ramOffset);
+  if (ram == MAP_FAILED) {
+    error("cannot map snapshot file '%s'", snapName);
+  }
+  ramMapped = true;
+  close(fd);
+  memInit();
+  for (i = 0; i < GRAPH_SIZE; i += 4) {
+    graphWrite(i >> 2, ram[(GRAPH_BASE - RAM_BASE + i) >> 2]);
+  }
+  printf("Machine snapshot restored from file '%s'\n", snapName);
 }
 
 
-void cpuHalt(void) {
-  run = false;
-}
-
+/**************************************************************/
 
-void cpuSetInterrupt(int priority) {
-  irqPending |= ((unsigned) 1 << priority);
-}
+/*
+ * screenshots
+ *     the frame buffer is written as a binary PBM file,
+ *     read through the graphics interface, so this works
+ *     with any display backend (including headless)
+ */
 
 
-void cpuResetInterrupt(int priority) {
-  irqPending &= ~((unsigned) 1 << priority);
-}
+#define SHOT_SIZE_X	1024
+#define SHOT_SIZE_Y	768
 
 
-void cpuInit(Word initialPC) {
+void screenShot(char *shotName) {
+  FILE *shotFile;
+  Byte line[SHOT_SIZE_X / 8];
+  Word data;
+  int x, y;
   int i;
 
-  pc = initialPC;
-  for (i = 0; i < 16; i++) {
-    reg[i] = 0;
+  shotFile = fopen(shotName, "w");
+  if (shotFile == NULL) {
+    error("cannot open screenshot file '%s'", shotName);
+  }
+  fprintf(shotFile, "P4\n%d %d\n", SHOT_SIZE_X, SHOT_SIZE_Y);
+  /* PBM starts at the top, the frame buffer at the bottom */
+  for (y = SHOT_SIZE_Y - 1; y >= 0; y--) {
+    memset(line, 0, sizeof(line));
+    for (x = 0; x < SHOT_SIZE_X; x += 32) {
+      data = graphRead((y * SHOT_SIZE_X + x) >> 5);
+      /* PBM has the leftmost pixel in the MSB, set bits black */
+      for (i = 0; i < 32; i++) {
+        if (data & ((Word) 1 << i)) {
+          line[(x + i) >> 3] |= 0x80 >> ((x + i) & 7);
+        }
+      }
+    }
+    fwrite(line, 1, sizeof(line), shotFile);
   }
-  ID = CPU_ID;
-  H = 0;
-  X = 0;
-  N = Z = C = V = I = P = false;
-  irqAck = 0;
-  irqMask = 0;
-  breakSet = false;
+  if (fclose(shotFile) != 0) {
+    error("cannot write screenshot file '%s'", shotName);
+  }
+  printf("Screenshot written to file '%s'\n", shotName);
 }
 
 
@@ -2735,7 +5914,7 @@ void cpuInit(Word initialPC) {
  */
 
 
-static char instrBuffer[100];
+static PER_MACHINE char instrBuffer[100];
 
 
 static char *regOps[16] = {
@@ -3074,6 +6253,7 @@ static void help(void) {
   printf("  ss      show/set switches\n");
   printf("  led     show LEDs\n");
   printf("  lcd     show LCD\n");
+  printf("  snap    save machine snapshot\n");
   printf("  q       quit simulator\n");
   printf("type 'help <cmd>' to get help for <cmd>\n");
 }
@@ -3690,6 +6870,34 @@ static void doLCD(char *tokens[], int n) {
 }
 
 
+static void helpSnap(void) {
+  printf("  snap <file>       save machine snapshot to <file>\n");
+}
+
+
+static void doSnap(char *tokens[], int n) {
+  if (n == 2) {
+    snapSave(tokens[1]);
+  } else {
+    helpSnap();
+  }
+}
+
+
+static void helpShot(void) {
+  printf("  shot <file>       save screenshot (PBM) to <file>\n");
+}
+
+
+static void doShot(char *tokens[], int n) {
+  if (n == 2) {
+    screenShot(tokens[1]);
+  } else {
+    helpShot();
+  }
+}
+
+
 static void helpQuit(void) {
   printf("  q                 quit simulator\n");
 }
@@ -3723,6 +6931,8 @@ Command commands[] = {
   { "ss",   helpSwitches,   doSwitches   },
   { "led",  helpLED,        doLED        },
   { "lcd",  helpLCD,        doLCD        },
+  { "snap", helpSnap,       doSnap       },
+  { "shot", helpShot,       doShot       },
   { "q",    helpQuit,       doQuit       },
 };
 
@@ -3760,6 +6970,314 @@ Bool execCommand(char *line) {
 }
 
 
+/**************************************************************/
+
+/*
+ * machine interface
+ *     Any number of machines can be hosted by a program, one
+ *     in each of its threads. Such a machine does not end the
+ *     program when it shuts down, it only stops running; an
+ *     error while it runs only ends the machine, too. The
+ *     library built by 'make lib' has no main program and no
+ *     display (see machine.h).
+ */
+
+
+struct machine {
+  pthread_t owner;		/* the thread holding the state */
+  Bool *run;			/* the owner's run flag */
+  Bool shutdown;		/* the machine has shut itself down */
+  int exitCode;			/* valid if shutdown */
+  Bool failed;			/* the machine has hit an error */
+  Bool inside;			/* running, escape is valid */
+  jmp_buf escape;		/* back to machineRun/machineStep */
+};
+
+
+static void initMachine(char *promName, char *ramName,
+                        char *diskName, Word initialSwitches) {
+  initHostTime();
+  initTimer();
+  initSWLED(initialSwitches);
+  initBTNSWT(initialSwitches);
+  initRS232_0();
+  initRS232_1();
+  initSPI(diskName);
+  initMouseKeybd();
+  initGPIO();
+  initHPT_0();
+  initHPT_1();
+  initLCD();
+  initPVD();
+  memInit();
+  promInit(promName);
+  ramInit(ramName);
+  cpuInit(promName != NULL ? ROM_BASE : RAM_BASE);
+}
+
+
+static void hostedShutdown(int exitCode) {
+  hosted->shutdown = true;
+  hosted->exitCode = exitCode;
+  cpuHalt();
+}
+
+
+/*
+ * called by error(): if this thread is running its machine,
+ * mark the machine as failed and get out of it, instead of
+ * ending the whole program
+ */
+static void hostedError(void) {
+  if (hosted == NULL || !hosted->inside) {
+    return;
+  }
+  hosted->inside = false;
+  hosted->failed = true;
+  SET_RUN(false);
+  longjmp(hosted->escape, 1);
+}
+
+
+static void checkOwner(Machine *m) {
+  if (m != hosted || !pthread_equal(m->owner, pthread_self())) {
+    error("machine used outside of its thread");
+  }
+}
+
+
+Machine *machineCreate(char *promName, char *ramName,
+                       char *diskName, Word initialSwitches) {
+  Machine *m;
+
+  if (hosted != NULL) {
+    error("this thread already hosts a machine");
+  }
+  m = malloc(sizeof(Machine));
+  if (m == NULL) {
+    error("cannot allocate machine");
+  }
+  m->owner = pthread_self();
+  m->run = &run;
+  m->shutdown = false;
+  m->exitCode = 0;
+  m->failed = false;
+  m->inside = false;
+  errorHook = hostedError;
+  hosted = m;
+  graphInit();
+  initMachine(promName, ramName, diskName, initialSwitches);
+  return m;
+}
+
+
+void machineStep(Machine *m) {
+  checkOwner(m);
+  if (m->shutdown || m->failed) {
+    return;
+  }
+  if (setjmp(m->escape) != 0) {
+    return;
+  }
+  m->inside = true;
+  cpuStep();
+  m->inside = false;
+}
+
+
+/*
+ * run until halted or shut down: returns the exit code
+ * of the shutdown, -1 if the machine was halted, or -2
+ * if it has hit an error (and cannot run any more)
+ */
+int machineRun(Machine *m) {
+  checkOwner(m);
+  if (m->failed) {
+    return -2;
+  }
+  if (m->shutdown) {
+    return m->exitCode;
+  }
+  if (setjmp(m->escape) != 0) {
+    hostStopRun();
+    return -2;
+  }
+  m->inside = true;
+  cpuRun();
+  m->inside = false;
+  return m->shutdown ? m->exitCode : -1;
+}
+
+
+/*
+ * stop a running machine, from any thread
+ */
+void machineHalt(Machine *m) {
+  __atomic_store_n(m->run, false, __ATOMIC_RELAXED);
+}
+
+
+void machineDestroy(Machine *m) {
+  checkOwner(m);
+  while (numEvents > 0) {
+    eventCancel(eventHeap[0]);
+  }
+  exitRS232_0();
+  exitRS232_1();
+  exitSPI();
+  memExit();
+  graphExit();
+  /* leave the thread ready for another machine */
+  simTime = 0;
+  hostRunTotal = 0;
+  paceLag = 0;
+  skippedTime = 0;
+  idleOwed = 0;
+  hosted = NULL;
+  free(m);
+}
+
+
+#ifndef SIM_LIBRARY
+
+
+/**************************************************************/
+
+/*
+ * batch mode
+ *     The machine is booted once, until it first idles in a
+ *     loop polling mouse or keyboard.
+ *     Then a child process is forked for every test script,
+ *     at most 'jobs' at a time. Each child keeps its disk
+ *     writes private, gets its own serial line 0, and runs
+ *     serlink on it with the script as input. The child ends
+ *     when serlink does, with serlink's exit status.
+ */
+
+
+#define MAX_BATCH	100
+#define SERLINK		"serlink"
+#define SERLINK_POLL	INST_PER_MSEC	/* look for serlink's exit */
+
+
+static PER_MACHINE pid_t serlinkPid;
+static PER_MACHINE int serlinkStatus;
+
+
+static void pollSerlink(Event *ev) {
+  if (waitpid(serlinkPid, &serlinkStatus, WNOHANG) == serlinkPid) {
+    cpuHalt();
+    return;
+  }
+  eventSchedule(ev, simTime + SERLINK_POLL);
+}
+
+
+static PER_MACHINE Event serlinkEvent = { "serlink", pollSerlink, 0, 0, -1 };
+
+
+static void batchChild(char *script) {
+  char slavePath[100];
+  char logName[LINE_SIZE];
+  int fd;
+
+  signal(SIGINT, SIG_DFL);
+  diskMakePrivate();
+  reopenRS232_0(slavePath);
+  reviveRS232_1();
+  snprintf(logName, LINE_SIZE, "%s.log", script);
+  serlinkPid = fork();
+  if (serlinkPid < 0) {
+    error("cannot fork serlink for script '%s'", script);
+  }
+  if (serlinkPid == 0) {
+    fd = open(script, O_RDONLY);
+    if (fd < 0) {
+      _exit(127);
+    }
+    dup2(fd, 0);
+    close(fd);
+    fd = open(logName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      _exit(127);
+    }
+    dup2(fd, 1);
+    dup2(fd, 2);
+    close(fd);
+    setenv("SERDEV", slavePath, 1);
+    execlp(SERLINK, SERLINK, (char *) NULL);
+    _exit(127);
+  }
+  eventSchedule(&serlinkEvent, simTime + SERLINK_POLL);
+  while (serlinkEvent.slot >= 0) {
+    cpuRun();
+  }
+  exit(WIFEXITED(serlinkStatus) ? WEXITSTATUS(serlinkStatus) : 1);
+}
+
+
+static int runBatch(char *scripts[], int numScripts, int jobs) {
+  pid_t pids[MAX_BATCH];
+  pid_t pid;
+  int status;
+  int next, running, failed;
+  int i;
+
+  printf("Booting...\n");
+  idleHalt = true;
+  cpuRun();
+  if (idleHalt) {
+    idleHalt = false;
+    printf("Machine stopped before becoming idle.\n");
+    return numScripts;
+  }
+  printf("Booted, running %d script(s), %d at a time...\n",
+         numScripts, jobs);
+  fflush(NULL);
+  next = 0;
+  running = 0;
+  failed = 0;
+  while (next < numScripts || running > 0) {
+    if (next < numScripts && running < jobs) {
+      pid = fork();
+      if (pid < 0) {
+        error("cannot fork batch job");
+      }
+      if (pid == 0) {
+        batchChild(scripts[next]);
+      }
+      pids[next++] = pid;
+      running++;
+      continue;
+    }
+    pid = wait(&status);
+    if (pid < 0) {
+      error("lost track of batch jobs");
+    }
+    for (i = 0; i < next; i++) {
+      if (pids[i] == pid) {
+        break;
+      }
+    }
+    if (i == next) {
+      /* not one of ours */
+      continue;
+    }
+    running--;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      printf("%-24s passed", scripts[i]);
+    } else {
+      printf("%-24s FAILED", scripts[i]);
+      failed++;
+    }
+    printf(", output in '%s.log'\n", scripts[i]);
+    fflush(stdout);
+  }
+  printf("%d of %d script(s) failed\n", failed, numScripts);
+  return failed;
+}
+
+
 /**************************************************************/
 
 /*
@@ -3772,8 +7290,30 @@ static void usage(char *myself) {
   printf("    [-i]                set interactive mode\n");
   printf("    [-p <PROM>]         set PROM image file name\n");
   printf("    [-r <RAM>]          set RAM image file name\n");
-  printf("    [-d <disk>]         set disk image file name\n");
+  printf("    [-d <disk>[:<ovl>]] set disk image (and overlay) file name\n");
+  printf("    [-msync <policy>]   sync disk: never, exit, every <n> sec\n");
+  printf("    [-restore <snap>]   restore machine snapshot at start\n");
+  printf("    [-save <snap>]      save machine snapshot at end\n");
+  printf("    [-shot <file>]      save screenshot (PBM) at end\n");
+  printf("    [-baud <rate>|inf]  initial serial line speed, or no delay\n");
+  printf("    [-vnc <port>]       serve display by RFB (VNC) on localhost\n");
   printf("    [-s <3 nibbles>]    set initial buttons(1)/switches(2)\n");
+  printf("    [-nodecodecache]    do not predecode instructions\n");
+  printf("    [-threaded]         use threaded-code execution engine\n");
+  printf("    [-checkevents]      check device event timing on every inst\n");
+#ifdef CHECK_FLAGS
+  printf("    [-checkflags]       check lazy flags against eager ones\n");
+#endif
+  printf("    [-bitserial]        multiply and divide bit by bit\n");
+  printf("    [-checkmuldiv]      check fast mul/div against bit-serial\n");
+  printf("    [-exactfpu]         floating-point by hardware models only\n");
+  printf("    [-checkfpu]         check fast floating-point against models\n");
+  printf("    [-fpustats]         show floating-point slow path use at end\n");
+  printf("    [-noidle]           do not skip idle loops\n");
+  printf("    [-paced]            throttle simulated time to real time\n");
+  printf("    [-turbo]            run timer on real time, CPU unthrottled\n");
+  printf("    [-batch <script>]   boot, then run serlink script in a fork\n");
+  printf("    [-jobs <n>]         number of batch scripts run in parallel\n");
   exit(1);
 }
 
@@ -3791,16 +7331,38 @@ int main(int argc, char *argv[]) {
   char *promName;
   char *ramName;
   char *diskName;
+  char *restoreName;
+  char *saveName;
+  char *shotName;
   Word initialSwitches;
   char *endp;
   char command[20];
   char *line;
+  char *scripts[MAX_BATCH];
+  int numScripts;
+  int jobs;
+  int failed;
+  Bool bitSerial;
+  Bool checkMulDiv;
+  Bool exactFpu;
+  Bool checkFpu;
+  Bool fpuStats;
 
   interactive = false;
   promName = NULL;
   ramName = NULL;
   diskName = NULL;
+  restoreName = NULL;
+  saveName = NULL;
+  shotName = NULL;
   initialSwitches = 0;
+  numScripts = 0;
+  jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  bitSerial = false;
+  checkMulDiv = false;
+  exactFpu = false;
+  checkFpu = false;
+  fpuStats = false;
   for (i = 1; i < argc; i++) {
     argp = argv[i];
     if (strcmp(argp, "-i") == 0) {
@@ -3824,6 +7386,42 @@ int main(int argc, char *argv[]) {
       }
       diskName = argv[++i];
     } else
+    if (strcmp(argp, "-baud") == 0) {
+      if (i == argc - 1) {
+        usage(argv[0]);
+      }
+      serialSetBaud(argv[++i]);
+    } else
+    if (strcmp(argp, "-msync") == 0) {
+      if (i == argc - 1) {
+        usage(argv[0]);
+      }
+      diskSetSync(argv[++i]);
+    } else
+    if (strcmp(argp, "-restore") == 0) {
+      if (i == argc - 1 || restoreName != NULL) {
+        usage(argv[0]);
+      }
+      restoreName = argv[++i];
+    } else
+    if (strcmp(argp, "-save") == 0) {
+      if (i == argc - 1 || saveName != NULL) {
+        usage(argv[0]);
+      }
+      saveName = argv[++i];
+    } else
+    if (strcmp(argp, "-shot") == 0) {
+      if (i == argc - 1 || shotName != NULL) {
+        usage(argv[0]);
+      }
+      shotName = argv[++i];
+    } else
+    if (strcmp(argp, "-vnc") == 0) {
+      if (i == argc - 1) {
+        usage(argv[0]);
+      }
+      graphSetRFB(argv[++i]);
+    } else
     if (strcmp(argp, "-s") == 0) {
       if (i == argc - 1) {
         usage(argv[0]);
@@ -3833,32 +7431,111 @@ int main(int argc, char *argv[]) {
       if (*endp != '\0') {
         error("illegal button/switch value, must be 3 hex digits");
       }
+    } else
+    if (strcmp(argp, "-nodecodecache") == 0) {
+      decodeCache = false;
+    } else
+    if (strcmp(argp, "-threaded") == 0) {
+      threaded = true;
+    } else
+    if (strcmp(argp, "-checkevents") == 0) {
+      checkEvents = true;
+      tickAlways = true;
+      /* the check counts every instruction */
+      idleDetect = false;
+    } else
+#ifdef CHECK_FLAGS
+    if (strcmp(argp, "-checkflags") == 0) {
+      checkFlags = true;
+      tickAlways = true;
+    } else
+#endif
+    if (strcmp(argp, "-bitserial") == 0) {
+      bitSerial = true;
+    } else
+    if (strcmp(argp, "-checkmuldiv") == 0) {
+      checkMulDiv = true;
+    } else
+    if (strcmp(argp, "-exactfpu") == 0) {
+      exactFpu = true;
+    } else
+    if (strcmp(argp, "-checkfpu") == 0) {
+      checkFpu = true;
+    } else
+    if (strcmp(argp, "-fpustats") == 0) {
+      fpuStats = true;
+    } else
+    if (strcmp(argp, "-noidle") == 0) {
+      idleDetect = false;
+    } else
+    if (strcmp(argp, "-paced") == 0) {
+      paced = true;
+    } else
+    if (strcmp(argp, "-turbo") == 0) {
+      turbo = true;
+    } else
+    if (strcmp(argp, "-batch") == 0) {
+      if (i == argc - 1 || numScripts == MAX_BATCH) {
+        usage(argv[0]);
+      }
+      scripts[numScripts++] = argv[++i];
+    } else
+    if (strcmp(argp, "-jobs") == 0) {
+      if (i == argc - 1) {
+        usage(argv[0]);
+      }
+      jobs = strtol(argv[++i], &endp, 10);
+      if (*endp != '\0' || jobs < 1) {
+        error("illegal number of jobs");
+      }
     } else {
       usage(argv[0]);
     }
   }
+  if (turbo && (paced || checkEvents)) {
+    /* the timer would no longer count instructions */
+    usage(argv[0]);
+  }
+  if (numScripts > 0 && (interactive || !idleDetect)) {
+    /* booting is over at the first idle loop */
+    usage(argv[0]);
+  }
+  if (jobs < 1) {
+    jobs = 1;
+  }
+  if (bitSerial && checkMulDiv) {
+    /* nothing to compare with */
+    usage(argv[0]);
+  }
+  if (exactFpu && checkFpu) {
+    /* nothing to compare with */
+    usage(argv[0]);
+  }
   signal(SIGINT, sigIntHandler);
   printf("RISC5 Simulator started\n");
-  if (promName == NULL && ramName == NULL && !interactive) {
+  intInit(bitSerial, checkMulDiv);
+  fpInit(exactFpu, checkFpu);
+  if (promName == NULL && ramName == NULL &&
+      restoreName == NULL && !interactive) {
     printf("Neither a PROM image file name nor a RAM image file\n");
-    printf("name was specified, so interactive mode is assumed.\n");
+    printf("name nor a snapshot was specified, so interactive\n");
+    printf("mode is assumed.\n");
     interactive = true;
   }
-  initTimer();
-  initSWLED(initialSwitches);
-  initBTNSWT(initialSwitches);
-  initRS232_0();
-  initRS232_1();
-  initSPI(diskName);
-  initMouseKeybd();
-  initGPIO();
-  initHPT_0();
-  initHPT_1();
-  initLCD();
-  graphInit();
-  promInit(promName);
-  ramInit(ramName);
-  cpuInit(promName != NULL ? ROM_BASE : RAM_BASE);
+  if (numScripts == 0) {
+    /* no window for batch jobs */
+    graphInit();
+  }
+  initMachine(promName, ramName, diskName, initialSwitches);
+  if (restoreName != NULL) {
+    snapRestore(restoreName);
+  }
+  if (numScripts > 0) {
+    failed = runBatch(scripts, numScripts, jobs);
+    showHostTime();
+    printf("RISC5 Simulator finished\n");
+    return failed == 0 ? 0 : 1;
+  }
   if (!interactive) {
     printf("Start executing...\n");
     strcpy(command, "c\n");
@@ -3875,7 +7552,23 @@ int main(int argc, char *argv[]) {
       }
     }
   }
+  if (saveName != NULL) {
+    snapSave(saveName);
+  }
+  if (shotName != NULL) {
+    screenShot(shotName);
+  }
+  exitRS232_0();
+  exitRS232_1();
+  exitSPI();
   graphExit();
+  if (fpuStats) {
+    fpStats();
+  }
+  showHostTime();
   printf("RISC5 Simulator finished\n");
   return 0;
 }
+
+
+#endif /* SIM_LIBRARY */
@@ -0,0 +1,217 @@
+/*
+ * ovldisk.c -- show, commit, or discard a disk overlay
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+#define SECTOR_SIZE	512
+
+/* the overlay file format, as defined in sim/sim.c */
+#define OVL_MAGIC	0x594C564F	/* 'OVLY' */
+#define OVL_VERSION	1
+#define OVL_BITMAP	4096		/* file offset of the bitmap */
+
+
+typedef struct {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int sectors;		/* number of sectors in the base */
+  unsigned int dataOffset;	/* file offset of sector 0 */
+  long long baseSize;		/* size of the base image */
+  long long baseMTime;		/* nanoseconds */
+} OvlHeader;
+
+
+void error(char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  fprintf(stderr, "Error: ");
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  exit(1);
+}
+
+
+void usage(void) {
+  fprintf(stderr, "Usage: ovldisk show <overlay>\n");
+  fprintf(stderr, "       ovldisk commit <base> <overlay>\n");
+  fprintf(stderr, "       ovldisk discard <overlay>\n");
+  fprintf(stderr, "       commit: write the sectors of the overlay\n");
+  fprintf(stderr, "               into the base, then discard them\n");
+  fprintf(stderr, "       discard: forget all sectors of the overlay\n");
+  exit(1);
+}
+
+
+/**************************************************************/
+
+
+char *ovlName;
+int ovlFd;
+OvlHeader hdr;
+unsigned char *bitmap;
+unsigned int bitmapSize;
+
+
+void readOverlay(char *name) {
+  ovlName = name;
+  ovlFd = open(ovlName, O_RDWR);
+  if (ovlFd < 0) {
+    error("cannot open overlay file '%s'", ovlName);
+  }
+  if (read(ovlFd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      hdr.magic != OVL_MAGIC || hdr.version != OVL_VERSION) {
+    error("file '%s' is not a disk overlay", ovlName);
+  }
+  bitmapSize = (hdr.sectors + 7) / 8;
+  bitmap = malloc(bitmapSize);
+  if (bitmap == NULL) {
+    error("out of memory");
+  }
+  if (pread(ovlFd, bitmap, bitmapSize, OVL_BITMAP) != bitmapSize) {
+    error("cannot read bitmap of overlay file '%s'", ovlName);
+  }
+}
+
+
+int inOverlay(unsigned int sector) {
+  return (bitmap[sector / 8] & (1 << (sector % 8))) != 0;
+}
+
+
+long long fileMTime(struct stat *st) {
+  return (long long) st->st_mtim.tv_sec * 1000000000 +
+         st->st_mtim.tv_nsec;
+}
+
+
+/*
+ * clear the bitmap and free the space of the sectors;
+ * the overlay then belongs to the base with status st
+ */
+void emptyOverlay(struct stat *st) {
+  off_t size;
+
+  size = hdr.dataOffset + (off_t) hdr.sectors * SECTOR_SIZE;
+  if (ftruncate(ovlFd, OVL_BITMAP) < 0 ||
+      ftruncate(ovlFd, size) < 0) {
+    error("cannot truncate overlay file '%s'", ovlName);
+  }
+  if (st != NULL) {
+    hdr.baseMTime = fileMTime(st);
+    if (pwrite(ovlFd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+      error("cannot write header of overlay file '%s'", ovlName);
+    }
+  }
+  if (fsync(ovlFd) < 0) {
+    error("cannot sync overlay file '%s'", ovlName);
+  }
+}
+
+
+/**************************************************************/
+
+
+void show(void) {
+  struct stat st;
+  unsigned int i;
+  unsigned int n;
+
+  n = 0;
+  for (i = 0; i < hdr.sectors; i++) {
+    if (inOverlay(i)) {
+      n++;
+    }
+  }
+  if (fstat(ovlFd, &st) < 0) {
+    error("cannot stat overlay file '%s'", ovlName);
+  }
+  printf("base image      : %lld bytes, %u sectors\n",
+         hdr.baseSize, hdr.sectors);
+  printf("sectors written : %u\n", n);
+  printf("space used      : %lld bytes\n", (long long) st.st_blocks * 512);
+}
+
+
+void commit(char *baseName) {
+  int baseFd;
+  struct stat st;
+  unsigned char buffer[SECTOR_SIZE];
+  unsigned int i;
+  unsigned int n;
+  off_t pos;
+
+  baseFd = open(baseName, O_RDWR);
+  if (baseFd < 0) {
+    error("cannot open disk image '%s'", baseName);
+  }
+  if (fstat(baseFd, &st) < 0) {
+    error("cannot stat disk image '%s'", baseName);
+  }
+  if (st.st_size != hdr.baseSize) {
+    error("overlay '%s' does not belong to disk image '%s'",
+          ovlName, baseName);
+  }
+  if (fileMTime(&st) != hdr.baseMTime) {
+    error("disk image '%s' has changed since overlay '%s' was made",
+          baseName, ovlName);
+  }
+  n = 0;
+  for (i = 0; i < hdr.sectors; i++) {
+    if (!inOverlay(i)) {
+      continue;
+    }
+    pos = (off_t) i * SECTOR_SIZE;
+    if (pread(ovlFd, buffer, SECTOR_SIZE,
+              hdr.dataOffset + pos) != SECTOR_SIZE) {
+      error("read error on overlay file '%s', sector %u", ovlName, i);
+    }
+    if (pwrite(baseFd, buffer, SECTOR_SIZE, pos) != SECTOR_SIZE) {
+      error("write error on disk image '%s', sector %u", baseName, i);
+    }
+    n++;
+  }
+  if (fsync(baseFd) < 0 || fstat(baseFd, &st) < 0) {
+    error("cannot sync disk image '%s'", baseName);
+  }
+  close(baseFd);
+  /* other overlays of this base are no longer valid */
+  emptyOverlay(&st);
+  printf("%u sectors committed to disk image '%s'\n", n, baseName);
+}
+
+
+void discard(void) {
+  emptyOverlay(NULL);
+  printf("overlay '%s' is empty now\n", ovlName);
+}
+
+
+int main(int argc, char *argv[]) {
+  if (argc == 3 && strcmp(argv[1], "show") == 0) {
+    readOverlay(argv[2]);
+    show();
+  } else
+  if (argc == 4 && strcmp(argv[1], "commit") == 0) {
+    readOverlay(argv[3]);
+    commit(argv[2]);
+  } else
+  if (argc == 3 && strcmp(argv[1], "discard") == 0) {
+    readOverlay(argv[2]);
+    discard();
+  } else {
+    usage();
+  }
+  close(ovlFd);
+  return 0;
+}